@@ -0,0 +1,219 @@
+// -*- mode:c++; c-basic-offset:2; coding:utf-8-unix -*-
+// ==================================================================================================
+#ifndef INCLUDE_GUARD_BATCH_SEARCH_H__
+#define INCLUDE_GUARD_BATCH_SEARCH_H__
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "board.h"
+#include "debug_msg.h"
+#include "eval_cache.h"
+#include "mcts.h"
+
+namespace mcts {
+
+// A finished self-play game.
+template<unsigned N>
+struct BasicGameRecord {
+  std::vector<go_engine::BasicMove<N>> moves;
+  // Search count of all moves (indexed by move id) when each move was chosen.
+  std::vector<std::array<unsigned, N * N + 1>> search_count;
+  // Black's score - White's score.
+  float score = 0.0f;
+};
+
+using GameRecord = BasicGameRecord<go_engine::N>;
+
+// Plays many self-play games at once from a single thread.
+//
+// Simulations of all games are interleaved: in each round, every game descends its tree until it
+// reaches a state needing eval (up to simulations_per_game times), the simulation is suspended
+// there, then states collected from all games are evaluated in a single batch and all suspended
+// simulations are resumed.  Compared with one thread per game blocking in NetworkEvalBridge, this
+// avoids per-thread stacks, semaphore round trips and context switches.
+//
+// options.threads and options.ponder are ignored since all searches are done by the calling thread.
+// Other limits of options.budget than simulations are checked between rounds.
+//
+// If cache_entries is positive, eval results are cached (see EvalCache), which is shared by both
+// players of all games.
+//
+// BatchEvalEngine is called as eval(boards, priors, values), where boards is a
+// std::vector<const go_engine::BasicBoardInfo<N>*>, and priors / values are vectors of
+// std::array<float, N * N + 1> / float of the same size to be filled.
+template<unsigned N, typename BatchEvalEngine>
+class BasicBatchSearch {
+  using BoardInfo = go_engine::BasicBoardInfo<N>;
+  using Move = go_engine::BasicMove<N>;
+  using GameRecord = BasicGameRecord<N>;
+  using EvalCache = BasicEvalCache<N>;
+  using Clock = std::chrono::steady_clock;
+  static constexpr size_t TotalMoves = BoardInfo::TotalMoves;
+
+  // Trees in this driver never evaluate states by themselves, this is only needed to satisfy the
+  // EvalEngine contract of Tree.
+  struct SingleEval {
+    float operator()(const BoardInfo& b, std::array<float, TotalMoves>& prior) {
+      std::vector<const BoardInfo*> boards{&b};
+      std::vector<std::array<float, TotalMoves>> priors(1);
+      std::vector<float> values(1);
+      owner->eval(boards, priors, values);
+      prior = priors[0];
+      return values[0];
+    }
+    BasicBatchSearch* owner;
+  };
+  using TreeType = BasicTree<N, SingleEval>;
+public:
+  template<typename T>
+  BasicBatchSearch(float komi, size_t game_count, T&& _eval, unsigned _simulations_per_game = 1,
+              size_t cache_entries = 0, const SearchOptions& options = {})
+    : eval(std::forward<T>(_eval))
+    , simulations_per_game(std::max(_simulations_per_game, 1U))
+    , budget(options.budget)
+    , eval_cache(cache_entries > 0 ? new EvalCache(cache_entries) : nullptr)
+  {
+    CHECK(game_count > 0);
+    for (size_t i = 0; i < game_count; ++i) {
+      games.emplace_back(new Game(komi, SingleEval{this}, simulations_per_game, options));
+    }
+  }
+  // Trees keep a pointer to this object.
+  BasicBatchSearch(const BasicBatchSearch&) = delete;
+  BasicBatchSearch& operator=(const BasicBatchSearch&) = delete;
+
+  // Keep playing until at least n more games are finished, and return all games finished.  Games
+  // not yet finished are continued by the next call.  If debug_log is true, moves of the first game
+  // are logged.
+  std::vector<GameRecord> play(size_t n, bool debug_log) {
+    std::vector<GameRecord> finished;
+    std::vector<std::pair<Game*, unsigned>> pending;
+    std::vector<const BoardInfo*> boards;
+    while (finished.size() < n) {
+      // 1. Descend all trees until new states are reached.
+      pending.clear();
+      boards.clear();
+      for (auto& g : games) {
+        TreeType& p = g->players[g->next_player];
+        unsigned k = 0;
+        while (k < simulations_per_game && g->started < budget.simulations) {
+          auto& sim = g->sims[k];
+          const SimulationState state = p.start_simulation(sim);
+          if (state == SimulationState::Abandoned) break;
+          // Creating the root node doesn't count as a simulation.
+          if (!sim.path.empty()) ++g->started;
+          if (state == SimulationState::NeedEval) {
+            pending.emplace_back(g.get(), k++);
+            boards.push_back(&*sim.board);
+          }
+        }
+      }
+
+      // 2. Evaluate all of them at once, except those found in the cache.
+      priors.resize(boards.size());
+      values.resize(boards.size());
+      misses.clear();
+      miss_boards.clear();
+      for (size_t j = 0; j < boards.size(); ++j) {
+        if (eval_cache == nullptr || !eval_cache->lookup(*boards[j], priors[j], values[j])) {
+          misses.push_back(j);
+          miss_boards.push_back(boards[j]);
+        }
+      }
+      if (!miss_boards.empty()) {
+        miss_priors.resize(miss_boards.size());
+        miss_values.resize(miss_boards.size());
+        eval(miss_boards, miss_priors, miss_values);
+        for (size_t k = 0; k < misses.size(); ++k) {
+          const size_t j = misses[k];
+          priors[j] = miss_priors[k];
+          values[j] = miss_values[k];
+          if (eval_cache != nullptr) {
+            eval_cache->insert(*boards[j], priors[j], values[j]);
+          }
+        }
+      }
+
+      // 3. Resume the simulations, and make a move in games done with searching.
+      for (size_t j = 0; j < pending.size(); ++j) {
+        Game* g = pending[j].first;
+        g->players[g->next_player].finish_simulation(g->sims[pending[j].second], priors[j], values[j]);
+      }
+      for (size_t i = 0; i < games.size(); ++i) {
+        Game& g = *games[i];
+        TreeType& p = g.players[g.next_player];
+        if (!p.search_limit(budget, g.started, g.start)) continue;
+        const Move move = p.select_move(debug_log && i == 0);
+        g.record.moves.push_back(move);
+        g.record.search_count.push_back(p.get_search_count());
+        for (auto& q : g.players) {
+          q.play(move);
+        }
+        g.next_player = go_engine::opposite_color(g.next_player);
+        g.started = 0;
+        g.start = Clock::now();
+        if (p.finished()) {
+          g.record.score = g.players[go_engine::BLACK].score();
+          LOG(debug_log && i == 0) << "Score = " << g.record.score << ".";
+          finished.push_back(std::move(g.record));
+          g.record = GameRecord();
+          for (auto& q : g.players) {
+            q.reset();
+          }
+          g.next_player = go_engine::BLACK;
+        }
+      }
+    }
+    return finished;
+  }
+
+  // nullptr if caching is disabled.
+  const EvalCache* cache() const {
+    return eval_cache.get();
+  }
+private:
+  struct Game {
+    Game(float komi, SingleEval e, unsigned simulations_per_game, const SearchOptions& options)
+      : players{{komi, go_engine::BLACK, e, without_pondering(options)},
+                {komi, go_engine::WHITE, e, without_pondering(options)}}
+      , sims(simulations_per_game)
+    {}
+
+    static SearchOptions without_pondering(SearchOptions options) {
+      options.ponder.simulations = 0;
+      return options;
+    }
+
+    TreeType players[2];
+    go_engine::Color next_player = go_engine::BLACK;
+    // Number of simulations started for the current move, and when its search started.
+    size_t started = 0;
+    Clock::time_point start = Clock::now();
+    // Slots of simulations in flight.
+    std::vector<typename TreeType::Simulation> sims;
+    GameRecord record;
+  };
+
+  BatchEvalEngine eval;
+  const unsigned simulations_per_game;
+  const SearchBudget budget;
+  std::vector<std::unique_ptr<Game>> games;
+  std::unique_ptr<EvalCache> eval_cache;
+  std::vector<std::array<float, TotalMoves>> priors;
+  std::vector<float> values;
+  // Indices (in the current batch) of states not found in the cache, and their eval results.
+  std::vector<size_t> misses;
+  std::vector<const BoardInfo*> miss_boards;
+  std::vector<std::array<float, TotalMoves>> miss_priors;
+  std::vector<float> miss_values;
+};
+
+template<typename BatchEvalEngine>
+using BatchSearch = BasicBatchSearch<go_engine::N, BatchEvalEngine>;
+}  // namespace mcts
+
+#endif  // #ifndef INCLUDE_GUARD_BATCH_SEARCH_H__
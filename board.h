@@ -3,17 +3,18 @@
 #ifndef INCLUDE_GUARD_BOARD_H__
 #define INCLUDE_GUARD_BOARD_H__
 
+#include <algorithm>
 #include <array>
+#include <bitset>
 #include <cmath>
+#include <cstdint>
 #include <cstring>
 #include <ctime>
 #include <fstream>
-#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <random>
 #include <sstream>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -22,16 +23,9 @@
 
 namespace go_engine {
 
-#ifndef BOARD_SIZE
-#error "Must define BOARD_SIZE."
-#endif
-
-// The size of the game board.
-static constexpr unsigned N = BOARD_SIZE;
-// We have data structures depending on N being small enough.
-static_assert(N <= 19);
-
-constexpr size_t TotalMoves = go_engine::N * go_engine::N + 1;
+// Everything depending on the size of the board is a template on the size N, so that boards of all
+// sizes can be used in one program, each with code specialized for its size.  Aliases with the
+// default size (BOARD_SIZE) are defined at the end of this file.
 
 enum Color {
   BLACK = 0,
@@ -46,8 +40,12 @@ inline Color opposite_color(Color c) {
   return static_cast<Color>(1U - c);
 }
 
-struct Move {
-  Move(Color c, unsigned id = N * N)
+template<unsigned N>
+struct BasicMove {
+  // loc below has 9 bits.
+  static_assert(N <= 19);
+
+  BasicMove(Color c, unsigned id = N * N)
     : color(c)
     , loc(id)
     , pass(id == N * N)
@@ -55,7 +53,7 @@ struct Move {
     ASSERT(id <= N * N);
   }
 
-  Move(Color c, unsigned row, unsigned col)
+  BasicMove(Color c, unsigned row, unsigned col)
     : color(c)
     , loc(row * N + col)
     , pass(0)
@@ -64,7 +62,7 @@ struct Move {
   }
 
 
-  Move(std::ifstream& input) {
+  BasicMove(std::ifstream& input) {
     std::string s;
     input >> s;
     CHECK(s.size() == 4 || s.size() == 6) << s;
@@ -123,11 +121,14 @@ struct Move {
   unsigned short pass : 1;
 };
 
-class ZobristHash {
+using ZobristHashType = uint64_t;
+
+template<unsigned N>
+class BasicZobristHash {
 public:
-  using type = uint64_t;
+  using type = ZobristHashType;
 
-  ZobristHash() {
+  BasicZobristHash() {
     // std::random_device rd;
     // std::default_random_engine engine(rd());
     std::default_random_engine engine(100);
@@ -140,34 +141,291 @@ public:
   type hash(unsigned loc, Color c) const {
     return seed[loc + (c == BLACK ? 0 : N * N)];
   }
+
+  // Hash of the game state besides stones on the board.
+  type white_to_move() const {
+    return seed[N * N * 2];
+  }
+  type passed() const {
+    return seed[N * N * 2 + 1];
+  }
 private:
-  std::array<uint64_t, N * N * 2> seed;
+  std::array<uint64_t, N * N * 2 + 2> seed;
+};
+
+template<unsigned N>
+inline const BasicZobristHash<N> zobrist_hash;
+
+// A set of locations on the board, one bit per location in row major order.
+//
+// The bits are padded to a power of 2 number of 64-bit words (i.e., 128, 256 and 512 bits for 9x9,
+// 13x13 and 19x19 boards), so that the compiler can use vector instructions for the word-wise
+// loops below.
+constexpr size_t next_power_of_2(size_t n) {
+  size_t r = 1;
+  while (r < n) r *= 2;
+  return r;
+}
+
+template<unsigned N>
+class BasicBitboard {
+  using Bitboard = BasicBitboard;
+public:
+  static constexpr size_t Words = next_power_of_2((N * N + 63) / 64);
+
+  constexpr BasicBitboard() = default;
+
+  constexpr void set(unsigned loc) {
+    ASSERT(loc < N * N) << loc;
+    w[loc / 64] |= uint64_t(1) << (loc % 64);
+  }
+
+  constexpr bool test(unsigned loc) const {
+    ASSERT(loc < N * N) << loc;
+    return (w[loc / 64] >> (loc % 64)) & 1;
+  }
+
+  bool any() const {
+    uint64_t r = 0;
+    for (size_t i = 0; i < Words; ++i) r |= w[i];
+    return r != 0;
+  }
+
+  // Call f(loc) for each location in the set, in increasing order.
+  template<typename F>
+  void for_each(F&& f) const {
+    for (size_t i = 0; i < Words; ++i) {
+      for (uint64_t b = w[i]; b != 0; b &= b - 1) {
+        f(static_cast<unsigned>(i * 64 + __builtin_ctzll(b)));
+      }
+    }
+  }
+
+  Bitboard operator|(const Bitboard& o) const {
+    Bitboard r;
+    for (size_t i = 0; i < Words; ++i) r.w[i] = w[i] | o.w[i];
+    return r;
+  }
+
+  bool operator==(const Bitboard& o) const {
+    return w == o.w;
+  }
+
+  unsigned count() const {
+    unsigned r = 0;
+    for (size_t i = 0; i < Words; ++i) r += __builtin_popcountll(w[i]);
+    return r;
+  }
+
+  // Locations in this set but not in o.
+  Bitboard and_not(const Bitboard& o) const {
+    Bitboard r;
+    for (size_t i = 0; i < Words; ++i) r.w[i] = w[i] & ~o.w[i];
+    return r;
+  }
+
+  Bitboard operator&(const Bitboard& o) const {
+    Bitboard r;
+    for (size_t i = 0; i < Words; ++i) r.w[i] = w[i] & o.w[i];
+    return r;
+  }
+
+  // Locations adjacent to any location in the set.
+  Bitboard neighbours() const;
+
+private:
+  // All locations on the board except those in column col.
+  static constexpr Bitboard column_complement(unsigned col);
+
+
+  // Move each location loc to loc + s (or loc - s), dropping those shifted out.  0 < s < 64.
+  Bitboard shift_up(unsigned s) const {
+    Bitboard r;
+    r.w[0] = w[0] << s;
+    for (size_t i = 1; i < Words; ++i) r.w[i] = (w[i] << s) | (w[i - 1] >> (64 - s));
+    return r;
+  }
+  Bitboard shift_down(unsigned s) const {
+    Bitboard r;
+    for (size_t i = 0; i + 1 < Words; ++i) r.w[i] = (w[i] >> s) | (w[i + 1] << (64 - s));
+    r.w[Words - 1] = w[Words - 1] >> s;
+    return r;
+  }
+
+  alignas(Words * 8) std::array<uint64_t, Words> w{};
+};
+
+template<unsigned N>
+constexpr BasicBitboard<N> BasicBitboard<N>::column_complement(unsigned col) {
+  Bitboard r;
+  for (unsigned loc = 0; loc < N * N; ++loc) {
+    if (loc % N != col) r.set(loc);
+  }
+  return r;
+}
+
+template<unsigned N>
+inline BasicBitboard<N> BasicBitboard<N>::neighbours() const {
+  // Locations which can be shifted by one column without wrapping around to another row.
+  static constexpr Bitboard not_last_col = column_complement(N - 1);
+  static constexpr Bitboard not_first_col = column_complement(0);
+  static constexpr Bitboard all = column_complement(N);
+  return (shift_up(N) | shift_down(N) | (*this & not_last_col).shift_up(1) |
+          (*this & not_first_col).shift_down(1)) & all;
+}
+
+// Locations adjacent to a location.
+struct Neighbours {
+  unsigned count = 0;
+  std::array<unsigned short, 4> loc{};
 };
 
-extern ZobristHash zobrist_hash;
-using ZobristHashType = typename ZobristHash::type;
+template<unsigned N>
+constexpr std::array<Neighbours, N * N> make_neighbour_table() {
+  std::array<Neighbours, N * N> table{};
+  for (unsigned loc = 0; loc < N * N; ++loc) {
+    Neighbours& adj = table[loc];
+    if (loc >= N)          adj.loc[adj.count++] = loc - N;
+    if (loc < N * (N - 1)) adj.loc[adj.count++] = loc + N;
+    if (loc % N > 0)       adj.loc[adj.count++] = loc - 1;
+    if (loc % N + 1 < N)   adj.loc[adj.count++] = loc + 1;
+  }
+  return table;
+}
+
+template<unsigned N>
+inline constexpr std::array<Neighbours, N * N> neighbour_table = make_neighbour_table<N>();
+
+// Hashes of all boards seen in a game, for the superko rule.
+//
+// This is an open addressing hash set with linear probing, sized for a game and grown by doubling,
+// whose memory is kept by clear().  A history may be layered over the history of a parent board,
+// in which case contains() also looks up hashes of the parent.
+//
+// Only the last inserted hash can be erased.  This is what BoardInfo::undo() needs, and it makes
+// erasing trivial: no other hash probes over the slot of the last inserted one.
+class SuperkoHistory {
+public:
+  // initial_size is the number of hashes expected, which is rounded up and doubled.
+  explicit SuperkoHistory(size_t _initial_size, const SuperkoHistory* _parent = nullptr)
+    : initial_size(next_power_of_2(std::max<size_t>(_initial_size, 128)) * 2)
+    , parent(_parent)
+  {}
+
+  SuperkoHistory(const SuperkoHistory&) = delete;
+  SuperkoHistory& operator=(const SuperkoHistory&) = delete;
+
+  bool contains(ZobristHashType h) const {
+    return find(h) || (parent != nullptr && parent->find(h));
+  }
+
+  // h must not be in this history.
+  void insert(ZobristHashType h) {
+    ASSERT(!find(h)) << std::hex << h;
+    if (2 * (keys.size() + 1) > table.size()) {
+      rehash(std::max<size_t>(table.size() * 2, initial_size));
+    }
+    place(h);
+    keys.push_back(h);
+  }
+
+  // Erase the last inserted hash.
+  void pop() {
+    CHECK(!keys.empty());
+    const ZobristHashType h = keys.back();
+    keys.pop_back();
+    if (h == 0) {
+      has_zero = false;
+      return;
+    }
+    size_t i = h & (table.size() - 1);
+    while (table[i] != h) i = (i + 1) & (table.size() - 1);
+    table[i] = 0;
+  }
+
+  void clear() {
+    std::fill(table.begin(), table.end(), 0);
+    keys.clear();
+    has_zero = false;
+  }
+
+  // Number of hashes in this history, excluding those of the parent.
+  size_t size() const {
+    return keys.size();
+  }
+
+  const SuperkoHistory* get_parent() const {
+    return parent;
+  }
+
+private:
+  bool find(ZobristHashType h) const {
+    if (h == 0) return has_zero;
+    if (table.empty()) return false;
+    for (size_t i = h & (table.size() - 1); table[i] != 0; i = (i + 1) & (table.size() - 1)) {
+      if (table[i] == h) return true;
+    }
+    return false;
+  }
+
+  // 0 marks empty slots, so the hash 0 is stored separately.
+  void place(ZobristHashType h) {
+    if (h == 0) {
+      has_zero = true;
+      return;
+    }
+    size_t i = h & (table.size() - 1);
+    while (table[i] != 0) i = (i + 1) & (table.size() - 1);
+    table[i] = h;
+  }
+
+  // Hashes are inserted again in the original order, so that pop() stays valid.
+  void rehash(size_t size) {
+    table.assign(size, 0);
+    for (ZobristHashType h : keys) place(h);
+  }
+
+  const size_t initial_size;
+  const SuperkoHistory* const parent;
+  std::vector<ZobristHashType> table;
+  // In the order of insertion.
+  std::vector<ZobristHashType> keys;
+  bool has_zero = false;
+};
 
 // This class is used to track:
 // 1. If 2 stones belong to the same group.
 // 2. The liberty count of each group.
-class BoardInfo {
+//
+// Both are maintained incrementally by play(), so checking the group or liberty count of a stone is
+// O(1).  Every change made by play() is also recorded, so that it can be reverted exactly with
+// undo().
+template<unsigned N>
+class BasicBoardInfo {
+  static_assert(N <= 19);
+  using BoardInfo = BasicBoardInfo;
+  using Bitboard = BasicBitboard<N>;
 public:
+  using Move = BasicMove<N>;
+  static constexpr size_t TotalMoves = N * N + 1;
+
   // Default constructor creates a state matching the beginning of the game.  komi is always added
   // to white player.
-  explicit BoardInfo(float _komi)
+  explicit BasicBoardInfo(float _komi)
     : komi(_komi)
+    , seen_states(2 * N * N)
   {}
 
-  explicit BoardInfo(const BoardInfo& b)
+  explicit BasicBoardInfo(const BasicBoardInfo& b)
     : komi(b.komi)
-    , existing_states(&b.seen_states)
     , board(b.board)
-    , unique_id(b.unique_id)
+    , groups(b.groups)
     , pass_count(b.pass_count)
     , next_player(b.next_player)
     , hash(b.hash)
+    , seen_states(2 * N * N, &b.seen_states)
   {
-    CHECK(b.existing_states == nullptr) << "Can't duplicate from an already duplicated board.";
+    CHECK(b.seen_states.get_parent() == nullptr) << "Can't duplicate from an already duplicated board.";
   }
 
   // Construct from a string representing the board.  This is mainly for debugging purposes.
@@ -177,8 +435,9 @@ public:
   // 2. X represents a black stone.
   // 3. O represents a white stone.
   // 4. All other characters are ignored.
-  explicit BoardInfo(const std::string& input, float _komi, Color _next_player)
+  explicit BasicBoardInfo(const std::string& input, float _komi, Color _next_player)
     : komi(_komi)
+    , seen_states(2 * N * N)
   {
     std::string s;
     for (char c : input) {
@@ -205,13 +464,16 @@ public:
   // Reset the board to a state matching the beginning of the game.  komi is not changed, although
   // this is not a hard requirement.
   void reset() {
-    CHECK(existing_states == nullptr) << "Can't reset a derived board.";
+    CHECK(seen_states.get_parent() == nullptr) << "Can't reset a derived board.";
     memset(&board, 0, sizeof(board));
-    unique_id = 0;
+    memset(&groups, 0, sizeof(groups));
     pass_count = 0;
     next_player = BLACK;
     hash = 0;
     seen_states.clear();
+    point_log.clear();
+    group_log.clear();
+    undo_log.clear();
   }
 
   std::string DebugString() const {
@@ -243,101 +505,53 @@ public:
   // Black's score - White's score.  So if score > 0, then black wins the game.  Use Tromp-Taylor
   // rules.
   float score() const {
-    unsigned count[2] = {0, 0};
-
-    const unsigned short mark = next_id();
-    // Return value is: color, count.
-    //
-    // Color == 0: This only occurs if the entire board is empty.
-    // Color == 1: The empty group containing loc is surrounded by black stones.  
-    // Color == 2: The empty group containing loc is surrounded by white stones.
-    // Color == 3: The empty group is not surrounded by a single type of stone.
-    std::function<std::pair<unsigned, unsigned>(unsigned)> check_empty =
-      [this, &check_empty, mark](unsigned loc) -> std::pair<unsigned, unsigned> {
-      ASSERT(loc < N * N) << loc;
-      if (board[loc].has_stone) {
-        return std::make_pair(board[loc].color == BLACK ? 1U : 2U, 0U);
-      }
-      if (board[loc].payload == mark) {
-        return std::make_pair(0U, 0U);
-      }
-      // Empty.
-      board[loc].payload = mark;
-      unsigned y = loc % N;
-
-      unsigned color = 0;
-      unsigned count = 1;
-      if (loc >= N) {
-        auto result = check_empty(loc - N);
-        color |= result.first;
-        count += result.second;
-      }
-      if (loc < N * (N - 1)) {
-        auto result = check_empty(loc + N);
-        color |= result.first;
-        count += result.second;
-      }
-      if (y > 0) {
-        auto result = check_empty(loc - 1);
-        color |= result.first;
-        count += result.second;
-      }
-      if (y + 1 < N) {
-        auto result = check_empty(loc + 1);
-        color |= result.first;
-        count += result.second;
-      }
-      return std::make_pair(color, count);
-    };
+    const std::array<unsigned, 2> count = area();
+    return (float)(count[BLACK]) - (float)(count[WHITE]) - komi;
+  }
+
+  // Area (stones and empty locations reaching only stones of the same color) of each player under
+  // Tromp-Taylor rules, indexed by color.  If ownership is not null, ownership[loc] is set to 1 for
+  // locations in black's area, -1 for white's and 0 for the others.
+  std::array<unsigned, 2> area(std::array<int8_t, N * N>* ownership = nullptr) const {
+    Bitboard stones[2], empty;
     for (unsigned loc = 0; loc < N * N; ++loc) {
-      if (board[loc].has_stone) {
-        ++count[board[loc].color];
-      } else if (board[loc].payload != mark) {
-        auto result = check_empty(loc);
-        ASSERT(result.first <= 3) << result.first << " " << result.second;
-        if (result.first == 1 || result.first == 2) {
-          count[result.first - 1] += result.second;
-        }
+      if (!board[loc].has_stone) {
+        empty.set(loc);
+      } else {
+        stones[board[loc].color].set(loc);
       }
     }
-    return (float)(count[BLACK]) - (float)(count[WHITE]) - komi;
+    Bitboard owned[2];
+    Bitboard reach[2];
+    for (int c = 0; c < 2; ++c) {
+      // Grow the empty locations adjacent to stones of color c until it covers their empty regions.
+      reach[c] = stones[c].neighbours() & empty;
+      while (true) {
+        const Bitboard next = (reach[c] | reach[c].neighbours()) & empty;
+        if (next == reach[c]) break;
+        reach[c] = next;
+      }
+    }
+    for (int c = 0; c < 2; ++c) {
+      owned[c] = stones[c] | reach[c].and_not(reach[1 - c]);
+    }
+    if (ownership != nullptr) {
+      ownership->fill(0);
+      owned[BLACK].for_each([ownership](unsigned loc) { (*ownership)[loc] = 1; });
+      owned[WHITE].for_each([ownership](unsigned loc) { (*ownership)[loc] = -1; });
+    }
+    return {owned[BLACK].count(), owned[WHITE].count()};
   }
 
-  // Count liberty of the group as well as the Zobrist hash of the group containing the stone at
+  // Liberty count of the group as well as the Zobrist hash of the group containing the stone at
   // loc.
   //
   // Assumes the input location has a stone.
   std::pair<unsigned, ZobristHashType> count_liberty(const unsigned loc) const {
     ASSERT(loc < N * N) << loc;
     ASSERT(board[loc].has_stone) << DebugString();
-
-    const unsigned short mark = next_id();
-    auto has_liberty = [this, mark](unsigned l) -> unsigned {
-      ASSERT(l < N * N);
-      if (board[l].has_stone || board[l].payload == mark) {
-        return 0;
-      }
-      board[l].payload = mark;
-      return 1;
-    };
-
-    unsigned p = loc;
-    unsigned count = 0;
-    ZobristHashType h = 0;
-    const Color c = static_cast<go_engine::Color>(board[loc].color);
-    do {
-      unsigned y = p % N;
-      h ^= zobrist_hash.hash(p, c);
-      if (p >= N)          count += has_liberty(p - N);
-      if (p < N * (N - 1)) count += has_liberty(p + N);
-      if (y > 0)           count += has_liberty(p - 1);
-      if (y + 1 < N)       count += has_liberty(p + 1);
-
-      ASSERT(p < N * N);
-      p = board[p].payload;
-      ASSERT(board[p].has_stone && board[p].color == c) << loc << " " << p << "\n" << DebugString();
-    } while (p != loc);
-    return std::make_pair(count, h);
+    const Group& g = groups[board[loc].head];
+    return std::make_pair(g.liberty, g.hash);
   }
 
   bool finished() const {
@@ -350,6 +564,43 @@ public:
     return next_player;
   }
 
+  float get_komi() const {
+    return komi;
+  }
+
+  // All valid moves of the next player, indexed by move id.  Same as calling is_valid() on every
+  // move, but computed with bitwise operations over the whole board at once.
+  std::bitset<TotalMoves> legal_moves() const {
+    std::bitset<TotalMoves> r;
+    if (finished()) return r;
+
+    Bitboard empty, safe, atari;
+    for (unsigned loc = 0; loc < N * N; ++loc) {
+      const Point& p = board[loc];
+      if (!p.has_stone) {
+        empty.set(loc);
+      } else if (p.color == next_player) {
+        if (groups[p.head].liberty > 1) safe.set(loc);
+      } else if (groups[p.head].liberty == 1) {
+        atari.set(loc);
+      }
+    }
+    // Playing next to an empty location, a friendly group with another liberty, or an opponent
+    // group in atari, is not a suicide.
+    const Bitboard capture = empty & atari.neighbours();
+    (empty & (empty | safe).neighbours()).for_each([this, &r, &capture](unsigned loc) {
+      if (!capture.test(loc) && !seen_states.contains(hash ^ zobrist_hash<N>.hash(loc, next_player))) {
+        r.set(loc);
+      }
+    });
+    // Captured groups change the hash, leave those to is_valid().
+    capture.for_each([this, &r](unsigned loc) {
+      if (is_valid(Move(next_player, loc))) r.set(loc);
+    });
+    r.set(N * N);
+    return r;
+  }
+
   // Check if this move is valid (i.e., it's not a suicide move and it doesn't violate the ko rule).
   //
   // Algorithm used (sans the ko rule part):
@@ -369,52 +620,36 @@ public:
     // check.
     bool maybe_valid = false;
 
-    ZobristHashType h = zobrist_hash.hash(move.loc, move.color == BLACK ? BLACK : WHITE);
-    std::array<ZobristHashType, 4> removed_group_hash;
+    ZobristHashType h = zobrist_hash<N>.hash(move.loc, move.color == BLACK ? BLACK : WHITE);
+    // Heads of groups captured by this move, a group may be adjacent to the move from more than one
+    // side.
+    std::array<unsigned short, 4> captured;
     size_t k = 0;
-    auto valid = [this, color=move.color, &removed_group_hash, &k](unsigned loc) -> bool {
-      ASSERT(loc < N * N);
+    for_each_neighbour(move.loc, [this, color=move.color, &maybe_valid, &h, &captured, &k](unsigned loc) {
       if (!board[loc].has_stone) {
-        return true;
+        maybe_valid = true;
+        return;
       }
-      auto v = count_liberty(loc);
-      ASSERT(v.first > 0) << loc << "\n" << DebugString();
+      const unsigned short head = board[loc].head;
+      const Group& g = groups[head];
+      ASSERT(g.liberty > 0) << loc << "\n" << DebugString();
       if (board[loc].color == color) {
-        return v.first > 1;
-      } else {
-        if (v.first == 1) {
-          removed_group_hash[k++] = v.second;
+        if (g.liberty > 1) maybe_valid = true;
+      } else if (g.liberty == 1) {
+        maybe_valid = true;
+        for (size_t i = 0; i < k; ++i) {
+          if (captured[i] == head) return;
         }
-        return v.first == 1;
+        captured[k++] = head;
+        h ^= g.hash;
       }
-    };
-
-    unsigned y = move.loc % N;
-    if (move.loc >= N && valid(move.loc - N))          maybe_valid = true;
-    if (move.loc < N * (N - 1) && valid(move.loc + N)) maybe_valid = true;
-    if (y > 0 && valid(move.loc - 1))                  maybe_valid = true;
-    if (y + 1 < N && valid(move.loc + 1))              maybe_valid = true;
-
-    // Crude method to avoid computing the hash of the same group twice.
-    for (size_t i = 0; i < k; ++i) {
-      h ^= removed_group_hash[i];
-      for (size_t j = 0; j < i; ++j) {
-        if (removed_group_hash[i] == removed_group_hash[j]) {
-          h ^= removed_group_hash[i];
-          break;
-        }
-      }
-    }
+    });
 
     if (__builtin_expect(maybe_valid, 1)) {
       // This implements the superko rule.  Since the hash doesn't record whose turn it is, this
       // effectively implements the positional superko rule, which forbids recreation of any
       // previously seen board configurations, regardless of whose turn it is.
-      if (existing_states != nullptr &&
-          existing_states->find(hash ^ h) != existing_states->end()) {
-        return false;
-      }
-      return seen_states.find(hash ^ h) == seen_states.end();
+      return !seen_states.contains(hash ^ h);
     } else {
       return false;
     }
@@ -422,6 +657,8 @@ public:
 
   void play(Move move) {
     ASSERT(is_valid(move)) << move.DebugString();
+    undo_log.push_back({static_cast<unsigned>(point_log.size()), static_cast<unsigned>(group_log.size()),
+                        hash, pass_count, next_player, !move.pass});
     next_player = opposite_color(next_player);
     if (move.pass) {
       ASSERT(pass_count <= 1) << pass_count;
@@ -432,140 +669,249 @@ public:
     }
 
     ASSERT(move.loc < N * N);
-    Point& point = board[move.loc];
-    hash ^= zobrist_hash.hash(move.loc, move.color == BLACK ? BLACK : WHITE);
+    const unsigned loc = move.loc;
+    const Color color = move.color == BLACK ? BLACK : WHITE;
+    Point& point = edit_point(loc);
+    hash ^= zobrist_hash<N>.hash(loc, color);
 
     point.has_stone = true;
-    point.color = move.color;
-    point.payload = move.loc;
-
-    // 1. Combine this stone and its adjacent stones of same color into one group.
-    auto combine_same_color = [this, loc=move.loc](unsigned adj) {
-      ASSERT(adj < N * N);
-      if (board[adj].has_stone && board[adj].color == board[loc].color && !same_group(loc, adj)) {
-        unsigned short t = board[loc].payload;
-        board[loc].payload = board[adj].payload;
-        board[adj].payload = t;
+    point.color = color;
+    point.payload = loc;
+    point.head = loc;
+    Group& group = edit_group(loc);
+    group.hash = zobrist_hash<N>.hash(loc, color);
+    group.liberty = 0;
+    group.size = 1;
+
+    // 1. loc is no longer a liberty of adjacent groups (each counted once), and empty adjacent
+    // locations are liberties of the new stone.
+    std::array<unsigned short, 4> adjacent;
+    size_t k = 0;
+    for_each_neighbour(loc, [this, &group, &adjacent, &k](unsigned adj) {
+      if (!board[adj].has_stone) {
+        ++group.liberty;
+        return;
       }
-    };
-    unsigned short col = move.loc % N;
-    if (move.loc >= N)          combine_same_color(move.loc - N);
-    if (move.loc < N * (N - 1)) combine_same_color(move.loc + N);
-    if (col > 0)                combine_same_color(move.loc - 1);
-    if (col + 1U < N)           combine_same_color(move.loc + 1);
-
-    // 3. For each adjacent *group* of opposite color, remove it if necessary.
-    auto update_opp = [this, loc=move.loc](unsigned l) {
-      ASSERT(l < N * N);
-      if (board[l].has_stone && board[l].color != board[loc].color) {
-        unsigned lc = count_liberty(l).first;
-        if (lc == 0) {
-          hash ^= remove_group(l);
-        }
+      const unsigned short head = board[adj].head;
+      for (size_t i = 0; i < k; ++i) {
+        if (adjacent[i] == head) return;
       }
-    };
+      adjacent[k++] = head;
+      --edit_group(head).liberty;
+    });
 
+    // 2. Combine this stone and its adjacent stones of same color into one group.
+    for (size_t i = 0; i < k; ++i) {
+      const unsigned short head = adjacent[i];
+      if (board[head].color == color) {
+        merge_groups(board[loc].head, head);
+      }
+    }
 
-    if (move.loc >= N)          update_opp(move.loc - N);
-    if (move.loc < N * (N - 1)) update_opp(move.loc + N);
-    if (col > 0)                update_opp(move.loc - 1);
-    if (col + 1U < N)           update_opp(move.loc + 1);
-    ASSERT(seen_states.find(hash) == seen_states.end())
+    // 3. For each adjacent *group* of opposite color, remove it if it has no liberty left.
+    for (size_t i = 0; i < k; ++i) {
+      const unsigned short head = adjacent[i];
+      if (board[head].has_stone && board[head].color != color && groups[head].liberty == 0) {
+        hash ^= remove_group(head);
+      }
+    }
+    ASSERT(!seen_states.contains(hash))
       << move.DebugString() << "\n" << DebugString() << std::hex << hash;
-    // ASSERT(seen_states.size() < 2 * N * N) << seen_states.size();
     seen_states.insert(hash);
   }
 
+  // Revert the last play() not reverted yet.  A duplicated board can't be reverted past the state it
+  // is duplicated from.
+  void undo() {
+    CHECK(!undo_log.empty()) << "Nothing to undo.";
+    const Undo& u = undo_log.back();
+    if (u.placed_stone) {
+      seen_states.pop();
+    }
+    for (size_t i = point_log.size(); i > u.point_log_size; --i) {
+      board[point_log[i - 1].first] = point_log[i - 1].second;
+    }
+    point_log.resize(u.point_log_size);
+    for (size_t i = group_log.size(); i > u.group_log_size; --i) {
+      groups[group_log[i - 1].first] = group_log[i - 1].second;
+    }
+    group_log.resize(u.group_log_size);
+    hash = u.hash;
+    pass_count = u.pass_count;
+    next_player = u.next_player;
+    undo_log.pop_back();
+  }
+
+  // Zobrist hash of the stones on the board (not including whose turn it is).
+  ZobristHashType get_hash() const {
+    return hash;
+  }
+
+  // Zobrist hash of the full game state: stones, whose turn it is and whether the last move is a
+  // pass.
+  ZobristHashType get_state_hash() const {
+    return hash ^ (next_player == WHITE ? zobrist_hash<N>.white_to_move() : 0) ^
+      (pass_count == 1 ? zobrist_hash<N>.passed() : 0);
+  }
+
   bool has_stone(unsigned loc, Color c) const {
     ASSERT(loc < N * N) << loc;
     return board[loc].has_stone && board[loc].color == c;
   }
 private:
+  // Call f(adj) for each location adj adjacent to loc.
+  template<typename F>
+  static void for_each_neighbour(unsigned loc, F&& f) {
+    ASSERT(loc < N * N) << loc;
+    const Neighbours& adj = neighbour_table<N>[loc];
+    for (unsigned i = 0; i < adj.count; ++i) {
+      f(adj.loc[i]);
+    }
+  }
+
+  // Remove the group containing loc, and return its Zobrist hash.
   ZobristHashType remove_group(const unsigned loc) {
     ASSERT(loc < N * N);
     ASSERT(board[loc].has_stone) << loc << "\n" << DebugString();
-    Color c = board[loc].color == BLACK ? BLACK : WHITE;
+    const unsigned short head = board[loc].head;
+    const ZobristHashType h = groups[head].hash;
+
+    // Each removed stone becomes a liberty of its adjacent groups (all of the opposite color).
     unsigned p = loc;
-    ZobristHashType h = 0;
+    do {
+      std::array<unsigned short, 4> adjacent;
+      size_t k = 0;
+      for_each_neighbour(p, [this, head, &adjacent, &k](unsigned adj) {
+        if (!board[adj].has_stone || board[adj].head == head) return;
+        const unsigned short h = board[adj].head;
+        for (size_t i = 0; i < k; ++i) {
+          if (adjacent[i] == h) return;
+        }
+        adjacent[k++] = h;
+        ++edit_group(h).liberty;
+      });
+      p = board[p].payload;
+    } while (p != loc);
+
     while(true) {
       ASSERT(p < N * N);
       unsigned next = board[p].payload;
-      memset(&board[p], 0, sizeof(Point));
-      h ^= zobrist_hash.hash(p, c);
+      memset(&edit_point(p), 0, sizeof(Point));
       p = next;
       if (p == loc) {
         break;
       }
-      ASSERT(board[p].has_stone && board[p].color == c) << loc << " " << p << "\n" << DebugString();
+      ASSERT(board[p].has_stone && board[p].head == head) << loc << " " << p << "\n" << DebugString();
     }
     return h;
   }
 
+  // Merge 2 different groups of the same color, identified by their heads.  The smaller group is
+  // merged into the larger one.
+  void merge_groups(unsigned short a, unsigned short b) {
+    ASSERT(board[a].head == a && board[b].head == b);
+    ASSERT(board[a].color == board[b].color);
+    if (a == b) return;
+    if (groups[a].size < groups[b].size) std::swap(a, b);
+    Group& group = edit_group(a);
+
+    // An empty location adjacent to a stone of b is a new liberty of a, unless it's adjacent to a
+    // stone of a already.  Stones of b are relabeled as they are visited, so that liberties shared
+    // by multiple stones of b are counted only once.
+    unsigned p = b;
+    do {
+      for_each_neighbour(p, [this, a, &group](unsigned adj) {
+        if (board[adj].has_stone) return;
+        bool counted = false;
+        for_each_neighbour(adj, [this, a, &counted](unsigned l) {
+          counted = counted || (board[l].has_stone && board[l].head == a);
+        });
+        if (!counted) ++group.liberty;
+      });
+      edit_point(p).head = a;
+      p = board[p].payload;
+    } while (p != b);
+
+    // Join the 2 circular linked lists.
+    unsigned short t = board[a].payload;
+    edit_point(a).payload = board[b].payload;
+    edit_point(b).payload = t;
+    group.size += groups[b].size;
+    group.hash ^= groups[b].hash;
+  }
+
   struct Point {
     unsigned short has_stone : 1;
     unsigned short color : 1;
 
-    // 1. For locations where there is a stone, this field is used to construct a circular linked list,
-    // i.e., its value is the index of the next stone in the linked list.
-    //
-    // 2. For empty locations, payload is used as a scratch space.  So far this is always used as a
-    // marker indicating if this location has been visited before.
-    //
-    // The way we count liberties: pick up a unique number that's guaranteed to be not equal to any
-    // payload field of any currently unoccupied locations.  When we go over the linked list, we
-    // mark any adjacent empty location using this unique number, this provides a way to avoid
-    // duplicated counting.
-    mutable unsigned short payload : 14;
+    // For locations where there is a stone, this field is used to construct a circular linked list,
+    // i.e., its value is the index of the next stone in the linked list.  Always 0 for empty
+    // locations.
+    unsigned short payload : 14;
+
+    // For locations where there is a stone: location of the head stone of its group, which
+    // identifies the group.
+    unsigned short head;
   };
 
-  // Check if 2 stones belong to the same group.
-  bool same_group(unsigned la, unsigned lb) const {
-    ASSERT(la < N * N && lb < N * N);
-    ASSERT(board[la].has_stone && board[lb].has_stone);
-    if (board[la].color != board[lb].color) return false;
+  // Only valid at the head of a group.
+  struct Group {
+    // Zobrist hash of all stones of the group.
+    ZobristHashType hash;
+    unsigned short liberty;
+    // Number of stones.
+    unsigned short size;
+  };
 
-    unsigned p = la;
-    do {
-      ASSERT(p < N * N);
-      if (p == lb) return true;
-      p = board[p].payload;
-      ASSERT(board[p].has_stone && board[p].color == board[la].color);
-    } while (p != la);
-    return false;
+  // Every change to board and groups made by play() goes through these, which record the old value.
+  Point& edit_point(unsigned loc) {
+    point_log.emplace_back(loc, board[loc]);
+    return board[loc];
   }
-
-  // Choose a unique ID for functions requiring a marker on empty locations such as count_liberty(),
-  // score().
-  //
-  // We keep an internal value, add 1 to it, and return the updated value every time we need a new
-  // unique ID.  This ensures that the returned value is never seen before.  When this internal
-  // value wraps around, we reset the payload field of all empty locations on the board (expensive).
-  //
-  // Obviously, this method is not thread safe, and one must be very careful if the payload field of
-  // empty locations are also used for other purposes (which is not the case so far).
-  unsigned short next_id() const {
-    ++unique_id;
-    if (__builtin_expect(unique_id < (1U << 14), 1)) {
-      return unique_id;
-    }
-    // Reset the payload field of all empty space to 0.
-    for (size_t loc = 0; loc < N * N; ++loc) {
-      if (!board[loc].has_stone) {
-        board[loc].payload = 0;
-      }
-    }
-    return unique_id = 1;
+  Group& edit_group(unsigned head) {
+    group_log.emplace_back(head, groups[head]);
+    return groups[head];
   }
 
+  // State before a play(), changes made by it are point_log and group_log entries beyond the recorded
+  // sizes.
+  struct Undo {
+    unsigned point_log_size;
+    unsigned group_log_size;
+    ZobristHashType hash;
+    unsigned short pass_count;
+    Color next_player;
+    // The hash of the new board is added to seen_states.
+    bool placed_stone;
+  };
+
   const float komi;
-  const std::unordered_set<ZobristHashType>* existing_states = nullptr;
 
   std::array<Point, N * N> board{};
-  mutable unsigned short unique_id = 0;
+  std::array<Group, N * N> groups{};
   unsigned short pass_count = 0;
   Color next_player = BLACK;
   ZobristHashType hash = 0;
-  std::unordered_set<ZobristHashType> seen_states;
+  // Layered over that of the board this board is duplicated from, if any.
+  SuperkoHistory seen_states;
+
+  // Not copied by the duplicate constructor.  Capacity is kept after undo(), so that a board
+  // repeatedly advanced and reverted, e.g. by searches, stops allocating memory for them.
+  std::vector<std::pair<unsigned short, Point>> point_log;
+  std::vector<std::pair<unsigned short, Group>> group_log;
+  std::vector<Undo> undo_log;
 };
+
+#ifndef BOARD_SIZE
+#error "Must define BOARD_SIZE."
+#endif
+
+// The default size of the game board, for code not templated on it.
+constexpr unsigned N = BOARD_SIZE;
+constexpr size_t TotalMoves = N * N + 1;
+using Move = BasicMove<N>;
+using ZobristHash = BasicZobristHash<N>;
+using Bitboard = BasicBitboard<N>;
+using BoardInfo = BasicBoardInfo<N>;
 }  // namespace go_engine
 #endif  // #ifndef INCLUDE_GUARD_BOARD_H__
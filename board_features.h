@@ -0,0 +1,102 @@
+// -*- mode:c++; c-basic-offset:2; coding:utf-8-unix -*-
+// ==================================================================================================
+#ifndef INCLUDE_GUARD_BOARD_FEATURES_H__
+#define INCLUDE_GUARD_BOARD_FEATURES_H__
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "board.h"
+#include "debug_msg.h"
+
+namespace go_engine {
+
+// The 8 symmetries of the board (rotations and reflections).  Symmetry t transposes the board if
+// bit 2 is set, then flips rows if bit 0 is set and columns if bit 1 is set.  0 is the identity.
+constexpr unsigned SymmetryCount = 8;
+
+template<unsigned N>
+constexpr std::array<std::array<uint16_t, N * N + 1>, SymmetryCount> make_symmetry_table() {
+  std::array<std::array<uint16_t, N * N + 1>, SymmetryCount> table{};
+  for (unsigned t = 0; t < SymmetryCount; ++t) {
+    for (unsigned row = 0; row < N; ++row) {
+      for (unsigned col = 0; col < N; ++col) {
+        unsigned r = t & 4 ? col : row;
+        unsigned c = t & 4 ? row : col;
+        if (t & 1) r = N - 1 - r;
+        if (t & 2) c = N - 1 - c;
+        table[t][row * N + col] = r * N + c;
+      }
+    }
+    // Pass is unchanged.
+    table[t][N * N] = N * N;
+  }
+  return table;
+}
+
+// symmetry_table<N>[t][m] is move id m transformed by symmetry t.
+template<unsigned N>
+inline constexpr auto symmetry_table = make_symmetry_table<N>();
+
+// Fill the network input for board b: 3 planes of N * N values, which are stones of the player to
+// move, stones of the opponent and the color of the player to move.  The board is transformed by
+// symmetry t.
+template<unsigned N>
+inline void fill_input_planes(const BasicBoardInfo<N>& b, float* input, unsigned t = 0) {
+  constexpr size_t BoardSize = N * N;
+  const auto& sym = symmetry_table<N>[t];
+  Color color = b.get_next_player();
+  for (size_t m = 0; m < BoardSize; ++m) {
+    const size_t s = sym[m];
+    input[s] = b.has_stone(m, color);
+    input[s + BoardSize] = b.has_stone(m, opposite_color(color));
+    input[s + 2 * BoardSize] = color;
+  }
+}
+
+// Training targets of a position: search counts normalized into a policy (smoothed so that no move
+// has probability 0), and whether the player to move won, in [1e-5, 1 - 1e-5].
+template<unsigned N>
+inline void fill_targets(const std::array<float, N * N + 1>& count, Color color, float score, float* policy,
+                         float* value, unsigned t = 0) {
+  constexpr float Epsilon = 1.e-5f;
+  const auto& sym = symmetry_table<N>[t];
+  float sum = 0.0f;
+  for (float c : count) {
+    sum += c + Epsilon;
+  }
+  for (size_t m = 0; m < count.size(); ++m) {
+    policy[sym[m]] = (count[m] + Epsilon) / sum;
+  }
+  *value = Epsilon + (score < 0 ? color : 1 - color) * (1.0f - 2 * Epsilon);
+}
+
+// Replay a game and encode all its positions for training, which are moves.size() * symmetries
+// rows of x (3 * N * N), policy (N * N + 1) and value (1), where symmetries is 8 if all symmetries
+// are used, otherwise 1.  Rows of the same position are adjacent, in the order of symmetries.
+//
+// Return false if a move is invalid or the game doesn't end with the given score.
+template<unsigned N>
+bool encode_game(const std::vector<BasicMove<N>>& moves, const std::vector<std::array<float, N * N + 1>>& counts,
+                 float score, float komi, bool all_symmetries, float* x, float* policy, float* value) {
+  constexpr size_t InputSize = 3 * N * N;
+  constexpr size_t TotalMoves = N * N + 1;
+  ASSERT(moves.size() == counts.size());
+  const unsigned symmetries = all_symmetries ? SymmetryCount : 1;
+  BasicBoardInfo<N> b(komi);
+  for (size_t k = 0; k < moves.size(); ++k) {
+    if (!b.is_valid(moves[k])) return false;
+    for (unsigned t = 0; t < symmetries; ++t) {
+      const size_t row = k * symmetries + t;
+      fill_input_planes(b, x + row * InputSize, t);
+      fill_targets<N>(counts[k], (Color)moves[k].color, score, policy + row * TotalMoves, value + row, t);
+    }
+    b.play(moves[k]);
+  }
+  return b.score() == score;
+}
+}  // namespace go_engine
+
+#endif  // #ifndef INCLUDE_GUARD_BOARD_FEATURES_H__
@@ -0,0 +1,73 @@
+// -*- mode:c++; c-basic-offset:2; coding:utf-8-unix -*-
+// ==================================================================================================
+#ifndef INCLUDE_GUARD_BOARD_SIZES_H__
+#define INCLUDE_GUARD_BOARD_SIZES_H__
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "board.h"
+
+namespace go_engine {
+
+// Board sizes selectable at runtime.  Each of them has its own instantiation of the templates on
+// the board size, holders of such objects dispatch with BySize.
+constexpr unsigned SupportedSizes[] = {9, 13, 19};
+
+// Holds an object of type T<N> for one of the supported sizes N.  Objects are held by pointer, so
+// that T doesn't need to be movable.
+template<template<unsigned> class T>
+struct BySize {
+  std::variant<std::unique_ptr<T<9>>, std::unique_ptr<T<13>>, std::unique_ptr<T<19>>> object;
+};
+
+// Construct T<size>(args...) in v.  Return false if size is not supported.
+template<template<unsigned> class T, typename... Args>
+bool emplace_by_size(BySize<T>& v, unsigned size, Args&&... args) {
+  switch (size) {
+  case 9:
+    v.object = std::make_unique<T<9>>(std::forward<Args>(args)...);
+    return true;
+  case 13:
+    v.object = std::make_unique<T<13>>(std::forward<Args>(args)...);
+    return true;
+  case 19:
+    v.object = std::make_unique<T<19>>(std::forward<Args>(args)...);
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Call f(std::integral_constant<unsigned, size>()) and return true, or return false if size is not
+// supported.
+template<typename F>
+bool dispatch_by_size(unsigned size, F&& f) {
+  switch (size) {
+  case 9:
+    f(std::integral_constant<unsigned, 9>());
+    return true;
+  case 13:
+    f(std::integral_constant<unsigned, 13>());
+    return true;
+  case 19:
+    f(std::integral_constant<unsigned, 19>());
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Return f(object) for the object held by v, which must have been constructed.
+template<template<unsigned> class T, typename F>
+decltype(auto) visit_by_size(BySize<T>& v, F&& f) {
+  return std::visit([&f](auto& p) -> decltype(auto) {
+      CHECK(p != nullptr) << "Object is not initialized.";
+      return f(*p);
+    }, v.object);
+}
+}  // namespace go_engine
+
+#endif  // #ifndef INCLUDE_GUARD_BOARD_SIZES_H__
@@ -1,16 +1,18 @@
 from distutils.core import setup, Extension
 
-cxxargs = ['-std=c++17', '-O3']
+# -march=native for the SIMD kernels of CpuNetwork, INT8 needs AVX2 or VNNI to be faster than float.
+cxxargs = ['-std=c++17', '-O3', '-march=native']
 ldargs = []
 
 modules = [
     Extension('mcts',
-              sources=['mcts_py_binding.C', 'Zobrist.C'],
-              depends=['board.h', 'config.h', 'debug_msg.h', 'mcts.h', 'eval_bridge.h'],
+              sources=['mcts_py_binding.C'],
+              depends=['board.h', 'board_features.h', 'config.h', 'debug_msg.h', 'mcts.h', 'eval_batcher.h', 'eval_bridge.h', 'batch_search.h', 'eval_cache.h',
+                       'board_sizes.h', 'game_io.h', 'opening_book.h', 'replay_buffer.h', 'self_play.h', 'cpu_network.h', 'shared_eval.h'],
               extra_compile_args=cxxargs, extra_link_args=ldargs, language='c++'),
     Extension('board',
-              sources=['board_py_binding.C', 'Zobrist.C'],
-              depends=['board.h', 'config.h', 'debug_msg.h'],
+              sources=['board_py_binding.C'],
+              depends=['board.h', 'board_features.h', 'board_sizes.h', 'config.h', 'debug_msg.h'],
               extra_compile_args=cxxargs, extra_link_args=ldargs, language='c++'),
 ]
 
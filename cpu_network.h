@@ -0,0 +1,654 @@
+// -*- mode:c++; c-basic-offset:2; coding:utf-8-unix -*-
+// ==================================================================================================
+#ifndef INCLUDE_GUARD_CPU_NETWORK_H__
+#define INCLUDE_GUARD_CPU_NETWORK_H__
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__AVXVNNI__) || (defined(__AVX512VNNI__) && defined(__AVX512VL__))
+#define CPU_NETWORK_VNNI
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "board.h"
+#include "board_features.h"
+#include "debug_msg.h"
+
+namespace mcts {
+
+// Weights of the network built by build_network_model() in tf_network.py, as written by
+// Network.export_weights().  All values are little endian:
+//
+//   Header: "MCTSNETW", then uint32 version, board size, channels of the trunk, residual blocks,
+//   units of the hidden value layer and the data format of the convolutions of the heads (0 for
+//   channels_last, 1 for channels_first).
+//   float32 weights of each layer in the Keras layout (conv kernels [3][3][in][out], dense kernels
+//   [in][out], each followed by its bias), in this order: trunk conv, 2 convs per residual block,
+//   policy conv, policy dense, value conv, hidden value dense, value dense.
+class NetworkWeights {
+public:
+  static constexpr char Magic[8] = {'M', 'C', 'T', 'S', 'N', 'E', 'T', 'W'};
+  static constexpr uint32_t Version = 1;
+  enum HeadFormat : uint32_t { ChannelsLast = 0, ChannelsFirst = 1 };
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t board_size;
+    uint32_t channels;
+    uint32_t blocks;
+    uint32_t value_units;
+    uint32_t head_format;
+  };
+  static_assert(sizeof(Header) == 32);
+
+  // Check ok() before using the weights.
+  explicit NetworkWeights(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.read((char*)&header, sizeof(header)) ||
+        memcmp(header.magic, Magic, sizeof(Magic)) != 0 || header.version != Version ||
+        header.board_size < 3 || header.channels < 3 || header.value_units == 0 ||
+        header.head_format > ChannelsFirst) {
+      return;
+    }
+    const std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (bytes.size() != weight_count() * sizeof(float)) return;
+    data.resize(weight_count());
+    memcpy(data.data(), bytes.data(), bytes.size());
+    valid = true;
+  }
+
+  bool ok() const {
+    return valid;
+  }
+
+  // Number of floats following the header.
+  size_t weight_count() const {
+    const size_t s = header.board_size, c = header.channels, u = header.value_units;
+    const size_t moves = s * s + 1;
+    const auto [a, b, i] = head_input_shape();
+    return (27 * c + c) + header.blocks * 2 * (9 * c * c + c) +
+      (9 * i * 2 + 2) + ((a - 2) * (b - 2) * 2 * moves + moves) +
+      (9 * i + 1) + ((a - 2) * (b - 2) * u + u) + (u + 1);
+  }
+
+  // The heads' convolutions see the trunk output as an image of a x b pixels with i channels.  With
+  // channels_last, Keras' default, which is what build_network_model() gets, that is the [channels]
+  // [board_size][board_size] tensor of the trunk read as height, width and channels.
+  std::array<size_t, 3> head_input_shape() const {
+    const size_t s = header.board_size, c = header.channels;
+    if (header.head_format == ChannelsLast) return {c, s, s};
+    return {s, s, c};
+  }
+
+  Header header{};
+  std::vector<float> data;
+private:
+  bool valid = false;
+};
+
+// Ranges of the inputs of the trunk convolutions, as measured by BasicCpuNetwork::calibrate().
+struct ActivationRanges {
+  std::vector<float> low;
+  std::vector<float> high;
+};
+
+// Forward pass of the network of NetworkWeights on CPU, for boards of size N.
+//
+// Convolutions of the trunk are computed as a GEMM of the kernels and the im2col matrix of the
+// input, in cache sized blocks and with a fixed size inner kernel the compiler vectorizes.  Batches
+// are split evenly among threads.
+//
+// Given ActivationRanges, the trunk runs in INT8 instead: kernels are quantized per output channel
+// to int8, inputs of convolutions per layer to uint8 (with a zero point, as they may be negative),
+// and products are accumulated in int32.  Outputs of convolutions, residuals and heads stay float.
+// The int32 GEMM uses VNNI (vpdpbusd) or else AVX2 (vpmaddwd) if the target has them, e.g. with
+// -march=native, otherwise it is slower than float.
+//
+// Satisfies the EvalEngine contract of Tree, and the BatchEvalEngine contract of BatchSearch, both
+// of which may be used from several threads at once.
+template<unsigned N>
+class BasicCpuNetwork {
+  using BoardInfo = go_engine::BasicBoardInfo<N>;
+  static constexpr size_t TotalMoves = BoardInfo::TotalMoves;
+  static constexpr size_t BoardSize = N * N;
+  static constexpr size_t InputSize = 3 * BoardSize;
+  // Register block of the GEMM kernel, and cache blocks of the depth and columns.
+  static constexpr size_t MR = 8;
+  static constexpr size_t NR = 8;
+  // SIMD vector of the GEMM kernel, the compiler picks instructions of the target.
+  typedef float Vec __attribute__((vector_size(16)));
+  static constexpr size_t Lanes = sizeof(Vec) / sizeof(float);
+  static constexpr size_t KC = 128;
+  static constexpr size_t NC = 512;
+  static constexpr float LeakyAlpha = 0.01f;
+  // Column block of the int8 GEMM, which isn't blocked in depth.
+  static constexpr size_t QNC = 128;
+
+  // 3x3 same padded convolution as [out][in][3][3] kernel.
+  struct TrunkConv {
+    size_t in;
+    std::vector<float> kernel;
+    std::vector<float> bias;
+  };
+  // TrunkConv quantized for inputs in a range.  Depth (in * 9) is padded with 0 weights to a multiple
+  // of 4, the inner product size of vpdpbusd.
+  struct QuantizedConv {
+    size_t depth;
+    // Input v is round(v / scale) + zero.
+    float scale;
+    uint8_t zero;
+    // [rows][depth], row o scaled by 1 / kernel_scale[o].
+    std::vector<int8_t> kernel;
+    // Same in int16, for AVX2 without VNNI.
+    std::vector<int16_t> wide_kernel;
+    // Output is bias + kernel_scale * (kernel * input - offset).
+    std::vector<float> kernel_scale;
+    std::vector<int32_t> offset;
+  };
+  // Valid 3x3 convolution, in the Keras layout.
+  struct HeadConv {
+    size_t out;
+    const float* kernel;
+    const float* bias;
+  };
+  struct Dense {
+    size_t in;
+    size_t out;
+    const float* kernel;
+    const float* bias;
+  };
+public:
+  // weights must be ok() and for board size N, and outlive the network.  The trunk runs in INT8 if
+  // int8 is not null.
+  BasicCpuNetwork(const NetworkWeights& _weights, unsigned _threads = 1, const ActivationRanges* int8 = nullptr)
+    : weights(_weights)
+    , channels(weights.header.channels)
+    , rows((channels + MR - 1) / MR * MR)
+    , threads(std::max(_threads, 1U))
+  {
+    CHECK(weights.ok() && weights.header.board_size == N) << weights.header.board_size;
+    const float* p = weights.data.data();
+    auto take = [&p](size_t n) {
+      const float* r = p;
+      p += n;
+      return r;
+    };
+    auto trunk_conv = [&take, this](size_t in) {
+      const float* kernel = take(9 * in * channels);
+      // Padded with 0 rows to a multiple of MR.
+      TrunkConv conv{in, std::vector<float>(9 * in * rows), std::vector<float>(rows)};
+      for (size_t k = 0; k < 9; ++k) {
+        for (size_t i = 0; i < in; ++i) {
+          for (size_t o = 0; o < channels; ++o) {
+            conv.kernel[(o * in + i) * 9 + k] = kernel[(k * in + i) * channels + o];
+          }
+        }
+      }
+      memcpy(conv.bias.data(), take(channels), sizeof(float) * channels);
+      return conv;
+    };
+    const auto [a, b, i] = weights.head_input_shape();
+    head_shape = {a, b, i};
+    const size_t features = (a - 2) * (b - 2);
+    const size_t units = weights.header.value_units;
+
+    trunk.push_back(trunk_conv(3));
+    for (size_t k = 0; k < 2 * weights.header.blocks; ++k) {
+      trunk.push_back(trunk_conv(channels));
+    }
+    policy_conv = {2, take(9 * i * 2), take(2)};
+    policy_dense = {features * 2, TotalMoves, take(features * 2 * TotalMoves), take(TotalMoves)};
+    value_conv = {1, take(9 * i), take(1)};
+    value_hidden = {features, units, take(features * units), take(units)};
+    value_dense = {units, 1, take(units), take(1)};
+    CHECK(p == weights.data.data() + weights.data.size());
+
+    if (int8 != nullptr) {
+      CHECK(int8->low.size() == trunk.size() && int8->high.size() == trunk.size());
+      for (size_t k = 0; k < trunk.size(); ++k) {
+        quantized.push_back(quantize(trunk[k], int8->low[k], int8->high[k]));
+      }
+    }
+  }
+  BasicCpuNetwork(const BasicCpuNetwork&) = delete;
+  BasicCpuNetwork& operator=(const BasicCpuNetwork&) = delete;
+
+  // Evaluate n rows of input (see fill_input_planes()), and write n rows of policy (TotalMoves
+  // probabilities) and value.
+  void forward(size_t n, const float* input, float* policy, float* value) const {
+    const size_t chunks = std::min<size_t>(threads, n);
+    if (chunks <= 1) {
+      forward_chunk(n, input, policy, value);
+      return;
+    }
+    const size_t rows = (n + chunks - 1) / chunks;
+    std::vector<std::thread> workers;
+    for (size_t begin = rows; begin < n; begin += rows) {
+      workers.emplace_back([=]() {
+          forward_chunk(std::min(rows, n - begin), input + begin * InputSize, policy + begin * TotalMoves,
+                        value + begin);
+        });
+    }
+    forward_chunk(rows, input, policy, value);
+    for (auto& w : workers) {
+      w.join();
+    }
+  }
+
+  bool is_quantized() const {
+    return !quantized.empty();
+  }
+
+  // Ranges of the trunk activations over n rows of input, to quantize the network.
+  ActivationRanges calibrate(size_t n, const float* input) const {
+    CHECK(!is_quantized());
+    ActivationRanges ranges{std::vector<float>(trunk.size(), 0.0f), std::vector<float>(trunk.size(), 0.0f)};
+    // In chunks to bound the size of the im2col matrix.
+    constexpr size_t Chunk = 64;
+    std::vector<float> policy(Chunk * TotalMoves);
+    std::vector<float> value(Chunk);
+    for (size_t begin = 0; begin < n; begin += Chunk) {
+      forward_chunk(std::min(Chunk, n - begin), input + begin * InputSize, policy.data(), value.data(), &ranges);
+    }
+    return ranges;
+  }
+
+  float operator()(const BoardInfo& b, std::array<float, TotalMoves>& prior) const {
+    std::array<float, InputSize> input;
+    go_engine::fill_input_planes(b, input.data());
+    float value;
+    forward(1, input.data(), prior.data(), &value);
+    return value;
+  }
+
+  void operator()(const std::vector<const BoardInfo*>& boards,
+                  std::vector<std::array<float, TotalMoves>>& priors,
+                  std::vector<float>& values) const {
+    const size_t n = boards.size();
+    std::vector<float> input(n * InputSize);
+    std::vector<float> policy(n * TotalMoves);
+    for (size_t i = 0; i < n; ++i) {
+      go_engine::fill_input_planes(*boards[i], input.data() + i * InputSize);
+    }
+    forward(n, input.data(), policy.data(), values.data());
+    for (size_t i = 0; i < n; ++i) {
+      memcpy(priors[i].data(), policy.data() + i * TotalMoves, sizeof(float) * TotalMoves);
+    }
+  }
+private:
+  // Ranges of the inputs of trunk convolutions are extended to the values seen if ranges is not null.
+  void forward_chunk(size_t n, const float* input, float* policy, float* value,
+                     ActivationRanges* ranges = nullptr) const {
+    // Activations are [channel][column] matrices, where column is sample * BoardSize + position,
+    // padded to a multiple of NR columns.
+    const size_t ld = (n * BoardSize + NR - 1) / NR * NR;
+    // Rows of outputs of convolutions are padded to a multiple of MR.
+    std::vector<float> x(rows * ld);
+    std::vector<float> t(rows * ld);
+    std::vector<float> u(rows * ld);
+    std::vector<float> columns(is_quantized() ? 0 : 9 * channels * ld);
+    std::vector<uint8_t> qcolumns(is_quantized() ? (9 * channels + 3) / 4 * 4 * ld : 0);
+    for (size_t s = 0; s < n; ++s) {
+      for (size_t c = 0; c < 3; ++c) {
+        memcpy(&x[c * ld + s * BoardSize], input + (s * 3 + c) * BoardSize, sizeof(float) * BoardSize);
+      }
+    }
+    auto conv = [&](size_t k, const float* in, float* out) {
+      if (ranges != nullptr) {
+        for (size_t i = 0; i < trunk[k].in; ++i) {
+          const auto [low, high] = std::minmax_element(in + i * ld, in + i * ld + n * BoardSize);
+          ranges->low[k] = std::min(ranges->low[k], *low);
+          ranges->high[k] = std::max(ranges->high[k], *high);
+        }
+      }
+      if (is_quantized()) {
+        convolve(quantized[k], trunk[k], in, ld, n, qcolumns.data(), out);
+      } else {
+        convolve(trunk[k], in, ld, n, columns.data(), out);
+      }
+    };
+    conv(0, x.data(), t.data());
+    leaky_relu(t.data(), channels * ld);
+    x.swap(t);
+    for (size_t k = 1; k < trunk.size(); k += 2) {
+      conv(k, x.data(), t.data());
+      leaky_relu(t.data(), channels * ld);
+      conv(k + 1, t.data(), u.data());
+      for (size_t j = 0; j < channels * ld; ++j) {
+        u[j] += x[j];
+      }
+      leaky_relu(u.data(), channels * ld);
+      x.swap(u);
+    }
+
+    const auto [a, b, i] = head_shape;
+    std::vector<float> features((a - 2) * (b - 2) * 2);
+    std::vector<float> hidden(value_hidden.out);
+    for (size_t s = 0; s < n; ++s) {
+      float* p = policy + s * TotalMoves;
+      head_convolve(policy_conv, x.data() + s * BoardSize, ld, features.data());
+      apply(policy_dense, features.data(), p);
+      const float max = *std::max_element(p, p + TotalMoves);
+      float sum = 0.0f;
+      for (size_t m = 0; m < TotalMoves; ++m) {
+        p[m] = std::exp(p[m] - max);
+        sum += p[m];
+      }
+      for (size_t m = 0; m < TotalMoves; ++m) {
+        p[m] /= sum;
+      }
+
+      head_convolve(value_conv, x.data() + s * BoardSize, ld, features.data());
+      apply(value_hidden, features.data(), hidden.data());
+      leaky_relu(hidden.data(), hidden.size());
+      apply(value_dense, hidden.data(), value + s);
+      value[s] = 1.0f / (1.0f + std::exp(-value[s]));
+    }
+  }
+
+  // Same padded convolution of n samples from in to out (both with ld columns).
+  void convolve(const TrunkConv& conv, const float* in, size_t ld, size_t n, float* columns, float* out) const {
+    // im2col: row (i * 9 + k) holds channel i shifted by offset k of the kernel.  Padding columns
+    // are never written and stay 0.
+    for (size_t i = 0; i < conv.in; ++i) {
+      for (size_t k = 0; k < 9; ++k) {
+        const int dy = (int)(k / 3) - 1;
+        const int dx = (int)(k % 3) - 1;
+        float* row = columns + (i * 9 + k) * ld;
+        const float* src = in + i * ld;
+        for (size_t s = 0; s < n; ++s) {
+          for (int y = 0; y < (int)N; ++y) {
+            for (int x = 0; x < (int)N; ++x) {
+              const int sy = y + dy, sx = x + dx;
+              row[s * BoardSize + y * N + x] =
+                (sy >= 0 && sy < (int)N && sx >= 0 && sx < (int)N) ? src[s * BoardSize + sy * N + sx] : 0.0f;
+            }
+          }
+        }
+      }
+    }
+    for (size_t o = 0; o < rows; ++o) {
+      std::fill(out + o * ld, out + (o + 1) * ld, conv.bias[o]);
+    }
+    gemm(rows, ld, conv.in * 9, conv.kernel.data(), columns, out);
+  }
+
+  QuantizedConv quantize(const TrunkConv& conv, float low, float high) const {
+    QuantizedConv q;
+    q.depth = (conv.in * 9 + 3) / 4 * 4;
+    low = std::min(low, 0.0f);
+    high = std::max(high, 0.0f);
+    q.scale = high > low ? (high - low) / 255.0f : 1.0f;
+    q.zero = (uint8_t)std::clamp(std::lround(-low / q.scale), 0L, 255L);
+    q.kernel.resize(rows * q.depth);
+    q.wide_kernel.resize(rows * q.depth);
+    q.kernel_scale.resize(rows);
+    q.offset.resize(rows);
+    for (size_t o = 0; o < rows; ++o) {
+      const float* w = conv.kernel.data() + o * conv.in * 9;
+      float max = 0.0f;
+      for (size_t j = 0; j < conv.in * 9; ++j) {
+        max = std::max(max, std::abs(w[j]));
+      }
+      const float scale = max > 0.0f ? max / 127.0f : 1.0f;
+      int32_t sum = 0;
+      for (size_t j = 0; j < conv.in * 9; ++j) {
+        const int8_t v = (int8_t)std::lround(w[j] / scale);
+        q.kernel[o * q.depth + j] = v;
+        q.wide_kernel[o * q.depth + j] = v;
+        sum += v;
+      }
+      q.kernel_scale[o] = scale * q.scale;
+      q.offset[o] = sum * q.zero;
+    }
+    return q;
+  }
+
+  // Same as above with a quantized convolution.  columns is the im2col matrix in uint8, with groups
+  // of 4 rows interleaved: element (r, j) is at ((r / 4) * ld + j) * 4 + r % 4.
+  void convolve(const QuantizedConv& q, const TrunkConv& conv, const float* in, size_t ld, size_t n, uint8_t* columns,
+                float* out) const {
+    const float inverse = 1.0f / q.scale;
+    std::vector<uint8_t> input(n * BoardSize);
+    // Out of board inputs are 0 and padding rows have 0 weights.
+    std::fill(columns, columns + q.depth * ld, q.zero);
+    for (size_t i = 0; i < conv.in; ++i) {
+      for (size_t j = 0; j < n * BoardSize; ++j) {
+        input[j] = (uint8_t)std::clamp(std::nearbyint(in[i * ld + j] * inverse) + q.zero, 0.0f, 255.0f);
+      }
+      for (size_t k = 0; k < 9; ++k) {
+        const int dy = (int)(k / 3) - 1;
+        const int dx = (int)(k % 3) - 1;
+        const size_t r = i * 9 + k;
+        uint8_t* row = columns + (r / 4) * ld * 4 + r % 4;
+        for (size_t s = 0; s < n; ++s) {
+          for (int y = std::max(0, -dy); y < std::min((int)N, (int)N - dy); ++y) {
+            for (int x = std::max(0, -dx); x < std::min((int)N, (int)N - dx); ++x) {
+              row[(s * BoardSize + y * N + x) * 4] = input[s * BoardSize + (y + dy) * N + x + dx];
+            }
+          }
+        }
+      }
+    }
+    for (size_t j0 = 0; j0 < ld; j0 += QNC) {
+      const size_t j1 = std::min(j0 + QNC, ld);
+      for (size_t i = 0; i < rows; i += MR) {
+        for (size_t j = j0; j < j1; j += NR) {
+          quantized_kernel(q, conv, i, columns + j * 4, ld, out + i * ld + j);
+        }
+      }
+    }
+  }
+
+  // MR x NR block of a quantized convolution at row i, with b and c at the first column.
+  static void quantized_kernel(const QuantizedConv& q, const TrunkConv& conv, size_t i, const uint8_t* b, size_t ld,
+                               float* c) {
+    int32_t acc[MR][NR];
+#if defined(CPU_NETWORK_VNNI)
+    static_assert(NR == 8);
+    const int8_t* a = q.kernel.data() + i * q.depth;
+    __m256i sum[MR];
+    for (size_t r = 0; r < MR; ++r) {
+      sum[r] = _mm256_setzero_si256();
+    }
+    for (size_t p = 0; p < q.depth / 4; ++p) {
+      const __m256i column = _mm256_loadu_si256((const __m256i*)(b + p * ld * 4));
+      for (size_t r = 0; r < MR; ++r) {
+        int32_t w;
+        memcpy(&w, a + r * q.depth + p * 4, sizeof(w));
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+        sum[r] = _mm256_dpbusd_epi32(sum[r], column, _mm256_set1_epi32(w));
+#else
+        sum[r] = _mm256_dpbusd_avx_epi32(sum[r], column, _mm256_set1_epi32(w));
+#endif
+      }
+    }
+    for (size_t r = 0; r < MR; ++r) {
+      _mm256_storeu_si256((__m256i*)acc[r], sum[r]);
+    }
+#elif defined(__AVX2__)
+    static_assert(NR == 8);
+    // Inputs widened to int16, so vpmaddwd sums pairs of the 4 products of a column, which are
+    // added up at the end.  Half of the rows at a time, to keep sums in registers.
+    constexpr size_t Half = MR / 2;
+    const int16_t* a = q.wide_kernel.data() + i * q.depth;
+    for (size_t r0 = 0; r0 < MR; r0 += Half) {
+      __m256i sum[Half][2];
+      for (size_t r = 0; r < Half; ++r) {
+        sum[r][0] = sum[r][1] = _mm256_setzero_si256();
+      }
+      for (size_t p = 0; p < q.depth / 4; ++p) {
+        const __m256i column = _mm256_loadu_si256((const __m256i*)(b + p * ld * 4));
+        const __m256i low = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(column));
+        const __m256i high = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(column, 1));
+        for (size_t r = 0; r < Half; ++r) {
+          int64_t w;
+          memcpy(&w, a + (r0 + r) * q.depth + p * 4, sizeof(w));
+          const __m256i weight = _mm256_set1_epi64x(w);
+          sum[r][0] = _mm256_add_epi32(sum[r][0], _mm256_madd_epi16(low, weight));
+          sum[r][1] = _mm256_add_epi32(sum[r][1], _mm256_madd_epi16(high, weight));
+        }
+      }
+      for (size_t r = 0; r < Half; ++r) {
+        // Sums of columns 0, 1, 4, 5, 2, 3, 6, 7.
+        const __m256i columns = _mm256_hadd_epi32(sum[r][0], sum[r][1]);
+        _mm256_storeu_si256((__m256i*)acc[r0 + r], _mm256_permute4x64_epi64(columns, 0xd8));
+      }
+    }
+#else
+    const int8_t* a = q.kernel.data() + i * q.depth;
+    for (size_t r = 0; r < MR; ++r) {
+      std::fill(acc[r], acc[r] + NR, 0);
+    }
+    for (size_t p = 0; p < q.depth / 4; ++p) {
+      const uint8_t* column = b + p * ld * 4;
+      for (size_t r = 0; r < MR; ++r) {
+        const int8_t* w = a + r * q.depth + p * 4;
+        for (size_t j = 0; j < NR; ++j) {
+          acc[r][j] += w[0] * column[j * 4] + w[1] * column[j * 4 + 1] + w[2] * column[j * 4 + 2] +
+            w[3] * column[j * 4 + 3];
+        }
+      }
+    }
+#endif
+    for (size_t r = 0; r < MR; ++r) {
+      for (size_t j = 0; j < NR; ++j) {
+        c[r * ld + j] = conv.bias[i + r] + q.kernel_scale[i + r] * (float)(acc[r][j] - q.offset[i + r]);
+      }
+    }
+  }
+
+  // c[m][n] += a[m][k] * b[k][n], where m is a multiple of MR and n of NR.
+  static void gemm(size_t m, size_t n, size_t k, const float* a, const float* b, float* c) {
+    for (size_t j0 = 0; j0 < n; j0 += NC) {
+      const size_t j1 = std::min(j0 + NC, n);
+      for (size_t p0 = 0; p0 < k; p0 += KC) {
+        const size_t depth = std::min(KC, k - p0);
+        for (size_t i = 0; i < m; i += MR) {
+          for (size_t j = j0; j < j1; j += NR) {
+            kernel(depth, a + i * k + p0, k, b + p0 * n + j, n, c + i * n + j, n);
+          }
+        }
+      }
+    }
+  }
+
+  // MR x NR block of c, kept in registers.
+  static void kernel(size_t depth, const float* a, size_t lda, const float* b, size_t ldb, float* c, size_t ldc) {
+    Vec acc[MR][NR / Lanes];
+    for (size_t r = 0; r < MR; ++r) {
+      for (size_t v = 0; v < NR / Lanes; ++v) {
+        acc[r][v] = load(c + r * ldc + v * Lanes);
+      }
+    }
+    for (size_t p = 0; p < depth; ++p) {
+      Vec row[NR / Lanes];
+      for (size_t v = 0; v < NR / Lanes; ++v) {
+        row[v] = load(b + p * ldb + v * Lanes);
+      }
+      for (size_t r = 0; r < MR; ++r) {
+        const float w = a[r * lda + p];
+        for (size_t v = 0; v < NR / Lanes; ++v) {
+          acc[r][v] += w * row[v];
+        }
+      }
+    }
+    for (size_t r = 0; r < MR; ++r) {
+      for (size_t v = 0; v < NR / Lanes; ++v) {
+        store(c + r * ldc + v * Lanes, acc[r][v]);
+      }
+    }
+  }
+
+  static Vec load(const float* p) {
+    Vec v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static void store(float* p, Vec v) {
+    memcpy(p, &v, sizeof(v));
+  }
+
+  // Valid convolution of one sample of the trunk output (at column 0 of in), followed by leaky
+  // ReLU.  out is flattened as Keras' Flatten (with its default data format) does with the output of
+  // the convolution: [a - 2][b - 2][conv.out] with channels_last, [conv.out][a - 2][b - 2] with
+  // channels_first.
+  void head_convolve(const HeadConv& conv, const float* in, size_t ld, float* out) const {
+    const auto [a, b, channels_in] = head_shape;
+    // Strides of the image axes and channels in the trunk output.
+    const bool last = weights.header.head_format == NetworkWeights::ChannelsLast;
+    const size_t sa = last ? ld : N;
+    const size_t sb = last ? N : 1;
+    const size_t si = last ? 1 : ld;
+    // Strides of pixels and channels in out.
+    const size_t pixels = (a - 2) * (b - 2);
+    const size_t op = last ? conv.out : 1;
+    const size_t oc = last ? 1 : pixels;
+    for (size_t y = 0; y + 2 < a; ++y) {
+      for (size_t x = 0; x + 2 < b; ++x) {
+        float* o = out + (y * (b - 2) + x) * op;
+        for (size_t c = 0; c < conv.out; ++c) {
+          o[c * oc] = conv.bias[c];
+        }
+        for (size_t k = 0; k < 9; ++k) {
+          const float* src = in + (y + k / 3) * sa + (x + k % 3) * sb;
+          const float* w = conv.kernel + k * channels_in * conv.out;
+          for (size_t i = 0; i < channels_in; ++i) {
+            for (size_t c = 0; c < conv.out; ++c) {
+              o[c * oc] += src[i * si] * w[i * conv.out + c];
+            }
+          }
+        }
+      }
+    }
+    leaky_relu(out, pixels * conv.out);
+  }
+
+  static void apply(const Dense& dense, const float* in, float* out) {
+    std::copy(dense.bias, dense.bias + dense.out, out);
+    for (size_t i = 0; i < dense.in; ++i) {
+      const float* w = dense.kernel + i * dense.out;
+      for (size_t o = 0; o < dense.out; ++o) {
+        out[o] += in[i] * w[o];
+      }
+    }
+  }
+
+  static void leaky_relu(float* v, size_t n) {
+    for (size_t j = 0; j < n; ++j) {
+      v[j] = v[j] < 0.0f ? v[j] * LeakyAlpha : v[j];
+    }
+  }
+
+  const NetworkWeights& weights;
+  const size_t channels;
+  const size_t rows;
+  const unsigned threads;
+  std::array<size_t, 3> head_shape;
+  std::vector<TrunkConv> trunk;
+  // Empty unless the trunk runs in INT8.
+  std::vector<QuantizedConv> quantized;
+  HeadConv policy_conv;
+  Dense policy_dense;
+  HeadConv value_conv;
+  Dense value_hidden;
+  Dense value_dense;
+};
+
+using CpuNetwork = BasicCpuNetwork<go_engine::N>;
+}  // namespace mcts
+
+#endif  // #ifndef INCLUDE_GUARD_CPU_NETWORK_H__
@@ -0,0 +1,256 @@
+// -*- mode:c++; c-basic-offset:2; coding:utf-8-unix -*-
+// ==================================================================================================
+#ifndef INCLUDE_GUARD_EVAL_BATCHER_H__
+#define INCLUDE_GUARD_EVAL_BATCHER_H__
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "board_features.h"
+#include "debug_msg.h"
+
+namespace mcts {
+
+// A 32 bit word threads can wait on until it holds a given value.  Waiters spin before sleeping in
+// futex(2), for longer if recent spins succeeded, and store() only makes a syscall if a waiter is
+// sleeping.  Words in memory shared by processes must be process_shared.
+class FutexWord {
+  using Clock = std::chrono::steady_clock;
+  static constexpr unsigned MinSpins = 16;
+  static constexpr unsigned MaxSpins = 4096;
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && std::atomic<uint32_t>::is_always_lock_free);
+public:
+  explicit FutexWord(uint32_t v = 0, bool process_shared = false)
+    : value(v)
+    , private_flag(process_shared ? 0 : FUTEX_PRIVATE_FLAG)
+  {}
+
+  uint32_t load() const {
+    return value.load(std::memory_order_acquire);
+  }
+
+  // Release store, waking up all sleeping waiters.
+  void store(uint32_t v) {
+    // Sequentially consistent with the loads in wait(), so either a waiter sees v or sleepers is
+    // seen positive here.
+    value.store(v, std::memory_order_seq_cst);
+    wake();
+  }
+
+  // Same as store(load() + v), atomically.
+  void add(uint32_t v) {
+    value.fetch_add(v, std::memory_order_seq_cst);
+    wake();
+  }
+
+  // Block until the word is target, with acquire semantics.  Return false if deadline (if not null)
+  // passed first.
+  bool wait(uint32_t target, const Clock::time_point* deadline = nullptr) {
+    return wait_until([target](uint32_t v) { return v == target; }, deadline);
+  }
+
+  // Same as above, until reached(value) is true.
+  template<typename Predicate>
+  bool wait_until(Predicate reached, const Clock::time_point* deadline = nullptr) {
+    // Spinning only delays the thread we are waiting for on a single core.
+    static const bool spin = std::thread::hardware_concurrency() > 1;
+    const unsigned spins = spin ? spin_limit.load(std::memory_order_relaxed) : 0;
+    for (unsigned i = 0; i < spins; ++i) {
+      if (reached(load())) {
+        spin_limit.store(std::min(spins * 2, MaxSpins), std::memory_order_relaxed);
+        return true;
+      }
+      pause();
+    }
+    if (spin) {
+      spin_limit.store(std::max(spins / 2, MinSpins), std::memory_order_relaxed);
+    }
+
+    bool ok = true;
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+    while (true) {
+      const uint32_t v = value.load(std::memory_order_seq_cst);
+      if (reached(v)) break;
+      if (deadline == nullptr) {
+        syscall(SYS_futex, address(), FUTEX_WAIT | private_flag, v, nullptr, nullptr, 0);
+        continue;
+      }
+      const auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(*deadline - Clock::now()).count();
+      if (remaining <= 0) {
+        ok = false;
+        break;
+      }
+      timespec timeout{(time_t)(remaining / 1000000000), (long)(remaining % 1000000000)};
+      syscall(SYS_futex, address(), FUTEX_WAIT | private_flag, v, &timeout, nullptr, 0);
+    }
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+    return ok;
+  }
+private:
+  void wake() {
+    if (sleepers.load(std::memory_order_seq_cst) > 0) {
+      syscall(SYS_futex, address(), FUTEX_WAKE | private_flag, INT_MAX, nullptr, nullptr, 0);
+    }
+  }
+
+  uint32_t* address() {
+    return reinterpret_cast<uint32_t*>(&value);
+  }
+
+  static void pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+
+  std::atomic<uint32_t> value;
+  const int private_flag;
+  std::atomic<uint32_t> sleepers{0};
+  std::atomic<unsigned> spin_limit{256};
+};
+
+// Batches single-board eval requests from any number of threads (the EvalEngine contract of
+// Tree), and feeds them to a batch eval function run by a dedicated thread in serve().
+//
+// A batch is dispatched once it has batch_size requests, or once its first request has waited
+// max_wait (if max_wait is negative, only full batches are dispatched).  So a single caller gets
+// low latency, while many callers get full batches.
+//
+// Requests go through a ring of slots with per slot sequence numbers and no locks.  The request at
+// position p (counting all requests) uses slot p % capacity, whose sequence number is p when it is
+// free, p + 1 once its input is filled, and p + capacity once its output is read.  So the eval
+// thread takes the next batch as a run of filled slots, while callers of the previous batch still
+// read their output.  Callers wait for the count of evaluated requests, so a batch is released
+// with a single wake-up.  Sequence numbers and counts are truncated to 32 bits.
+template<unsigned N>
+class BasicEvalBatcher {
+  using BoardInfo = go_engine::BasicBoardInfo<N>;
+  using Clock = std::chrono::steady_clock;
+  static constexpr size_t TotalMoves = BoardInfo::TotalMoves;
+  static constexpr size_t InputSize = 3 * N * N;
+  // Ring capacity in batches.
+  static constexpr size_t BatchCount = 4;
+
+  struct alignas(64) Slot {
+    FutexWord sequence;
+    // Written before the input is published.
+    Clock::time_point time;
+    bool stop = false;
+  };
+public:
+  BasicEvalBatcher(size_t _batch_size, std::chrono::microseconds _max_wait)
+    : batch_size(std::max<size_t>(_batch_size, 1))
+    , max_wait(_max_wait)
+    , capacity(batch_size * BatchCount)
+    , slots(new Slot[capacity])
+    , input(capacity * InputSize)
+    , policy(capacity * TotalMoves)
+    , value(capacity)
+  {
+    for (size_t i = 0; i < capacity; ++i) {
+      slots[i].sequence.store(i);
+    }
+  }
+  BasicEvalBatcher(const BasicEvalBatcher&) = delete;
+  BasicEvalBatcher& operator=(const BasicEvalBatcher&) = delete;
+
+  size_t get_batch_size() const {
+    return batch_size;
+  }
+
+  // Called by search threads, blocks until the batch containing b is evaluated.
+  float operator()(const BoardInfo& b, std::array<float, TotalMoves>& prior) {
+    const uint64_t p = claim();
+    const size_t i = p % capacity;
+    go_engine::fill_input_planes(b, input.data() + i * InputSize);
+    slots[i].stop = false;
+    slots[i].sequence.store(p + 1);
+
+    evaluated.wait_until([p](uint32_t n) { return (int32_t)(n - (uint32_t)p) > 0; });
+    memcpy(prior.data(), policy.data() + i * TotalMoves, sizeof(float) * TotalMoves);
+    const float ret = value[i];
+    slots[i].sequence.store(p + capacity);
+    return ret;
+  }
+
+  // Evaluate batches until stop() is called.  BatchEval is called as eval(n, input, policy, value)
+  // and must write n rows of policy and value for n rows of input (see fill_input_planes()).
+  template<typename BatchEval>
+  void serve(BatchEval& eval) {
+    uint64_t head = 0;
+    while (true) {
+      const size_t first = head % capacity;
+      slots[first].sequence.wait(head + 1);
+      if (slots[first].stop) {
+        slots[first].sequence.store(head + capacity);
+        return;
+      }
+      // Batches don't wrap around the ring, so rows are contiguous.
+      const size_t limit = std::min(batch_size, capacity - first);
+      const Clock::time_point deadline = slots[first].time + max_wait;
+      size_t n = 1;
+      while (n < limit) {
+        const uint64_t p = head + n;
+        Slot& slot = slots[first + n];
+        if (max_wait.count() < 0) {
+          slot.sequence.wait(p + 1);
+        } else if (slot.sequence.load() != (uint32_t)(p + 1) && !slot.sequence.wait(p + 1, &deadline)) {
+          break;
+        }
+        // Requests after stop() are not served.
+        if (slot.stop) break;
+        ++n;
+      }
+      eval(n, input.data() + first * InputSize, policy.data() + first * TotalMoves, value.data() + first);
+      head += n;
+      evaluated.store(head);
+    }
+  }
+
+  // Make serve() return once all requests made before are evaluated.
+  void stop() {
+    const uint64_t p = claim();
+    const size_t i = p % capacity;
+    slots[i].stop = true;
+    slots[i].sequence.store(p + 1);
+  }
+private:
+  // Take the next request position, and wait until its slot is free.
+  uint64_t claim() {
+    const uint64_t p = tail.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = slots[p % capacity];
+    slot.sequence.wait(p);
+    slot.time = Clock::now();
+    return p;
+  }
+
+  const size_t batch_size;
+  const std::chrono::microseconds max_wait;
+  const size_t capacity;
+  std::unique_ptr<Slot[]> slots;
+  std::vector<float> input;
+  std::vector<float> policy;
+  std::vector<float> value;
+  alignas(64) std::atomic<uint64_t> tail{0};
+  // Number of requests evaluated.
+  alignas(64) FutexWord evaluated;
+};
+
+using EvalBatcher = BasicEvalBatcher<go_engine::N>;
+}  // namespace mcts
+
+#endif  // #ifndef INCLUDE_GUARD_EVAL_BATCHER_H__
@@ -4,200 +4,185 @@
 #define INCLUDE_GUARD_EVAL_BRIDGE_H__
 
 #include <array>
-#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <vector>
 #include <Python.h>
 #include <numpy/arrayobject.h>
 
-#include <semaphore.h>
-
 #include "board.h"
+#include "board_features.h"
 #include "debug_msg.h"
+#include "eval_batcher.h"
+#include "eval_cache.h"
+
+namespace mcts {
+// Call a Python eval function with n rows of input (see fill_input_planes()), and check the types
+// and shapes of the (policy, value) arrays it returns.  Return a new reference to the result.  The
+// GIL must be held.
+template<unsigned N>
+PyObject* call_py_eval(PyObject* eval, size_t n, float* input) {
+  constexpr size_t TotalMoves = go_engine::BasicBoardInfo<N>::TotalMoves;
+  npy_intp dims[4] = {(npy_intp)n, 3, N, N};
+  PyObject* array_obj = PyArray_SimpleNewFromData(4, dims, NPY_FLOAT, input);
+  PyObject* result = PyObject_CallFunctionObjArgs(eval, array_obj, nullptr);
+  Py_XDECREF(array_obj);
+  if (result == nullptr) {
+    PyErr_PrintEx(1);
+    CHECK(false) << "Failed calling Python eval function: nullptr returned.";
+  }
+  CHECK(PyTuple_Check(result) && PyTuple_Size(result) == 2) << "Callback must return a tuple of size 2.";
+  PyArrayObject* policy_output = (PyArrayObject*)PyTuple_GetItem(result, 0);
+  PyArrayObject* value_output = (PyArrayObject*)PyTuple_GetItem(result, 1);
+  ASSERT(PyArray_Check((PyObject*)policy_output)) << "Return value 1 is not PyArray.";
+  ASSERT(PyArray_Check((PyObject*)value_output)) << "Return value 2 is not PyArray.";
+  {
+    CHECK(PyArray_TYPE(policy_output) == NPY_FLOAT) << "Elements in returned PyArray are type " << PyArray_TYPE(policy_output) << ", expecting " << NPY_FLOAT;
+    CHECK(PyArray_NDIM(policy_output) == 2) << "Returned PyArray has a dimension other than 2: " << PyArray_NDIM(policy_output);
+    npy_intp* dims = PyArray_DIMS(policy_output);
+    CHECK(dims[0] == (npy_intp)n && dims[1] == TotalMoves)
+      << "Returned PyArray has size: (" << dims[0] << ", " << dims[1] << "), expecting ("
+      << n << ", " << TotalMoves << ").";
+  }
+  {
+    CHECK(PyArray_TYPE(value_output) == NPY_FLOAT) << "Elements in returned PyArray are type " << PyArray_TYPE(value_output) << ", expecting " << NPY_FLOAT;
+    CHECK(PyArray_NDIM(value_output) == 2) << "Returned PyArray has a dimension other than 2: " << PyArray_NDIM(value_output);
+    npy_intp* dims = PyArray_DIMS(value_output);
+    CHECK(dims[0] == (npy_intp)n && dims[1] == 1)
+      << "Returned PyArray has size: (" << dims[0] << ", " << dims[1] << "), expecting (" << n << ", 1).";
+  }
+  return result;
+}
 
 // This class accumulates pending eval requests from multiple threads, batch them and feed to the
 // underlying eval engine (e.g., tensorflow) for better performance.
-namespace mcts {
-template<size_t LogBatchSize>
-class NetworkEvalBridge {
-  static constexpr size_t BatchSize = 1ULL << LogBatchSize;
-  static constexpr size_t BoardSize = go_engine::N * go_engine::N;
-  static constexpr size_t BatchCopies = 16;
-  static constexpr size_t BufferSize = BatchCopies * BatchSize;
+//
+// Batches have at most batch_size boards, and are sent after waiting at most max_wait for more
+// requests (see EvalBatcher), so any number of threads may call operator().  The Python function
+// is called with a variable number of rows.
+template<unsigned N>
+class BasicNetworkEvalBridge {
+  using BoardInfo = go_engine::BasicBoardInfo<N>;
+  using EvalCache = BasicEvalCache<N>;
+  static constexpr size_t TotalMoves = BoardInfo::TotalMoves;
 public:
-  NetworkEvalBridge(PyObject* _eval)
+  // If cache_entries is positive, eval results are cached (see EvalCache).
+  BasicNetworkEvalBridge(PyObject* _eval, size_t batch_size = 32,
+                         std::chrono::microseconds max_wait = std::chrono::milliseconds(2),
+                         size_t cache_entries = 0)
     : eval(_eval)
+    , batcher(batch_size, max_wait)
+    , eval_cache(cache_entries > 0 ? new EvalCache(cache_entries) : nullptr)
   {
     CHECK(PyCallable_Check(eval)) << "Python object is not callable: " << PyUnicode_AsASCIIString(PyObject_Str(eval));
     Py_XINCREF(eval);
-    npy_intp dims[4] = {BatchSize, 3, go_engine::N, go_engine::N};
-    for (size_t i = 0; i < BatchCopies; ++i) {
-      args[i] = PyTuple_New(1);
-      PyObject* array_obj = PyArray_SimpleNewFromData(4, dims, NPY_FLOAT, input_buffer.data() + get_slot_offset(i * BatchSize));
-      PyTuple_SetItem(args[i], 0, array_obj);
-    }
-    sem_init(&eval_start, 0, 0);
-    for (size_t i = 0; i < BatchCopies; ++i) {
-      sem_init(&eval_done[i], 0, 0);
-      sem_init(&batch_done[i], 0, BatchSize);
-    }
   }
 
-  ~NetworkEvalBridge() {
+  ~BasicNetworkEvalBridge() {
     Py_XDECREF(eval);
-    for (size_t i = 0; i < BatchCopies; ++i) {
-      Py_XDECREF(args[i]);
-    }
-    sem_destroy(&eval_start);
-    for (size_t i = 0; i < BatchCopies; ++i) {
-      sem_destroy(&eval_done[i]);
-      sem_destroy(&batch_done[i]);
-    }
   }
   // Implementing copy constructor requires proper deep copy and handling of reference counting of Python objects.
-  template<typename... Dummy> NetworkEvalBridge(Dummy...) = delete;
+  template<typename... Dummy> BasicNetworkEvalBridge(Dummy...) = delete;
 
-  // # of threads calling operator() (eval) must be >= BatchSize and < 2 * BatchSize.
+  // Any number of threads may call operator() (eval), this many keep batches full while the
+  // previous batch is being evaluated.
   size_t worker_thread_count() {
-    return BatchSize * 1.5;
+    return batcher.get_batch_size() * 3 / 2;
   }
 
+  // Event loop, never returns.  Called with the GIL released, which is only held while calling the
+  // Python function.
   void startEval(PyThreadState *_save) {
-    // Event loop.
-    while (true) {
-      sem_wait(&eval_start);
-      std::atomic_thread_fence(std::memory_order_acquire);
-
-      uint64_t id = batch_id;
-      batch_id = -1;
-      CHECK(id < BatchCopies) << "Invalid batch_id: " << id;
+    auto call = [this, &_save](size_t n, float* input, float* policy, float* value) {
       PyEval_RestoreThread(_save);
-      PyObject* result = PyObject_CallObject(eval, args[id]);
-      if (result == nullptr) {
-        PyErr_PrintEx(1);
-        CHECK(false) << "Failed calling Python eval function: nullptr returned.";
+      PyObject* result = call_py_eval<N>(eval, n, input);
+      PyArrayObject* policy_output = (PyArrayObject*)PyTuple_GetItem(result, 0);
+      PyArrayObject* value_output = (PyArrayObject*)PyTuple_GetItem(result, 1);
+      for (size_t i = 0; i < n; ++i) {
+        memcpy(policy + i * TotalMoves, PyArray_GETPTR2(policy_output, i, 0), sizeof(float) * TotalMoves);
+        value[i] = *(const float*)PyArray_GETPTR2(value_output, i, 0);
       }
-      ASSERT(PyTuple_Check(result));
-      ASSERT(PyTuple_Size(result) == 2) << "Callback returns a tuple of size " << PyTuple_Size(result);
-
-      PyObject* policy_result = PyTuple_GetItem(result, 0);
-      PyObject* value_result = PyTuple_GetItem(result, 1);
-      Py_XINCREF(policy_result);
-      Py_XINCREF(value_result);
       Py_XDECREF(result);
-
-      ASSERT(PyArray_Check(policy_result)) << "Return value 1 is not PyArray.";
-      ASSERT(PyArray_Check(value_result)) << "Return value 2 is not PyArray.";
-      if (policy_output[id]) {
-        Py_XDECREF(policy_output[id]);
-      }
-      if (value_output[id]) {
-        Py_XDECREF(value_output[id]);
-      }
       _save = PyEval_SaveThread();
-      policy_output[id] = (PyArrayObject*)policy_result;
-      value_output[id] = (PyArrayObject*)value_result;
-      // Check output type & shape.
-      {
-        ASSERT(PyArray_TYPE(policy_output[id]) == NPY_FLOAT) << "Elements in returned PyArray are type " << PyArray_TYPE(policy_output[id]) << ", expecting " << NPY_FLOAT;
-        ASSERT(PyArray_NDIM(policy_output[id]) == 2) << "Returned PyArray has a dimension other than 2: " << PyArray_NDIM(policy_output[id]);
-        npy_intp* dims = PyArray_DIMS(policy_output[id]);
-        ASSERT(dims[0] == BatchSize && dims[1] == go_engine::TotalMoves)
-          << "Returned PyArray has size: (" << dims[0] << ", " << dims[1] << "), expecting ("
-          << BatchSize << ", " << go_engine::TotalMoves << ").";
-      }
-      {
-        ASSERT(PyArray_TYPE(value_output[id]) == NPY_FLOAT) << "Elements in returned PyArray are type " << PyArray_TYPE(value_output[id]) << ", expecting " << NPY_FLOAT;
-        ASSERT(PyArray_NDIM(value_output[id]) == 2) << "Returned PyArray has a dimension other than 2: " << PyArray_NDIM(value_output[id]);
-        npy_intp* dims = PyArray_DIMS(value_output[id]);
-        ASSERT(dims[0] == BatchSize && dims[1] == 1)
-          << "Returned PyArray has size: (" << dims[0] << ", " << dims[1] << "), expecting (" << BatchSize << ", 1).";
-      }
-
-      std::atomic_thread_fence(std::memory_order_release);
-      // Wake up all worker threads waiting for this batch.
-      for (size_t i = 0; i < BatchSize; ++i) {
-        sem_post(&eval_done[id]);
-      }
-    }  // while
+    };
+    batcher.serve(call);
   }
 
-  // MCTS Worker threads call this function to queue eval requests.  The function blocks until
-  // enough eval requests are accumulated so it can send them to the eval thread as a batch.
-  //
-  // Each slot has 3 states:
-  //
-  // 1. Unused.
-  // 2. Input filled, waiting for eval.
-  // 3. Eval done, waiting for output to be consumed.
-  //
-  // State change is a cycle: 1 -> 2 -> 3 -> 1.
-  float operator()(const go_engine::BoardInfo& b, std::array<float, go_engine::TotalMoves>& prior) {
-    go_engine::Color color = b.get_next_player();
-    const uint64_t my_eval_id = eval_count.fetch_add(1, std::memory_order_relaxed);
-    const uint64_t my_slot_id = my_eval_id % BufferSize;
-    const uint64_t my_batch_id = my_slot_id / BatchSize;
-    const uint64_t my_offset = get_slot_offset(my_slot_id);
-    
-    sem_wait(&batch_done[my_batch_id]);
-    std::atomic_thread_fence(std::memory_order_acquire);
-    for (size_t m = 0; m < BoardSize; ++m) {
-      input_buffer[my_offset + m] = b.has_stone(m, color);
-      input_buffer[my_offset + m + BoardSize] = b.has_stone(m, go_engine::opposite_color(color));
-      input_buffer[my_offset + m + 2 * BoardSize] = color;
-    }
-    if (input_filled[my_batch_id].fetch_add(1, std::memory_order_release) + 1 == BatchSize) {
-      // I'm the last one finishing this batch, so notify the eval thread.
-      batch_id = my_batch_id;
-      input_filled[my_batch_id].store(0, std::memory_order_relaxed);
-      std::atomic_thread_fence(std::memory_order_release);
-      sem_post(&eval_start);
+  // MCTS Worker threads call this function to queue eval requests.  The function blocks until the
+  // batch of the request is evaluated.
+  float operator()(const BoardInfo& b, std::array<float, TotalMoves>& prior) {
+    float cached_value;
+    if (eval_cache != nullptr && eval_cache->lookup(b, prior, cached_value)) {
+      return cached_value;
     }
-    // Now wait for the eval thread.
-    sem_wait(&eval_done[my_batch_id]);
-    std::atomic_thread_fence(std::memory_order_acquire);
-
-    // Copy eval result.
-    memcpy(prior.data(), PyArray_GETPTR2(policy_output[my_batch_id], my_slot_id % BatchSize, 0), sizeof(float) * go_engine::TotalMoves);
-    float ret = *(const float*)PyArray_GETPTR2(value_output[my_batch_id], my_slot_id % BatchSize, 0);
-
-    if (input_filled[my_batch_id].fetch_add(1, std::memory_order_release) + 1 == BatchSize) {
-      input_filled[my_batch_id].store(0, std::memory_order_relaxed);
-      std::atomic_thread_fence(std::memory_order_release);
-      // Allow the next batch of threads to enter.
-      for (size_t i = 0; i < BatchSize; ++i) {
-        sem_post(&batch_done[my_batch_id]);
-      }
+    const float ret = batcher(b, prior);
+    if (eval_cache != nullptr) {
+      eval_cache->insert(b, prior, ret);
     }
     return ret;
   }
-private:
-  size_t get_slot_offset(size_t slot) const {
-    ASSERT(slot < BufferSize) << "Invalid slot: " << slot << " >= " << BufferSize;
-    return slot * 3 * go_engine::N * go_engine::N;
-  }
 
+  // nullptr if caching is disabled.
+  const EvalCache* cache() const {
+    return eval_cache.get();
+  }
+private:
   PyObject* eval = nullptr;
-  std::array<PyObject*, BatchCopies> args{};
-  std::array<float, BufferSize * 3 * go_engine::N * go_engine::N> input_buffer{};
-  std::array<PyArrayObject*, BatchCopies> policy_output{};
-  std::array<PyArrayObject*, BatchCopies> value_output{};
+  BasicEvalBatcher<N> batcher;
+  std::unique_ptr<EvalCache> eval_cache;
+};
 
-  std::atomic<uint64_t> eval_count = 0;
-  std::array<std::atomic<uint64_t>, BatchCopies> input_filled{};
+// Evaluates a batch of boards in one call of a Python function, which has the same contract as the
+// one passed to NetworkEvalBridge.  Satisfies the BatchEvalEngine contract of BatchSearch.
+//
+// The GIL is only held during the call, so the caller doesn't need to hold it.
+template<unsigned N>
+class BasicPyBatchEval {
+  using BoardInfo = go_engine::BasicBoardInfo<N>;
+  static constexpr size_t TotalMoves = BoardInfo::TotalMoves;
+  static constexpr size_t BoardSize = N * N;
+public:
+  BasicPyBatchEval(PyObject* _eval)
+    : eval(_eval)
+  {
+    CHECK(PyCallable_Check(eval)) << "Python object is not callable: " << PyUnicode_AsASCIIString(PyObject_Str(eval));
+    Py_XINCREF(eval);
+  }
 
-  // These are used to signal the eval thread when a batch of eval requests are fully filled.
-  uint64_t batch_id = -1;
-  // Only one eval is possible at a time.  This is not too much of a restriction since GPU likes
-  // large batches.
-  sem_t eval_start;
+  ~BasicPyBatchEval() {
+    Py_XDECREF(eval);
+  }
+  // Implementing copy constructor requires proper deep copy and handling of reference counting of Python objects.
+  template<typename... Dummy> BasicPyBatchEval(Dummy...) = delete;
+
+  void operator()(const std::vector<const BoardInfo*>& boards,
+                  std::vector<std::array<float, TotalMoves>>& priors,
+                  std::vector<float>& values) {
+    const size_t n = boards.size();
+    input_buffer.resize(n * 3 * BoardSize);
+    for (size_t i = 0; i < n; ++i) {
+      go_engine::fill_input_planes(*boards[i], input_buffer.data() + i * 3 * BoardSize);
+    }
 
-  // eval_done: Used by the eval thread to signal worker threads to fetch their respective eval
-  // results and resume the work.
-  std::array<sem_t, BatchCopies> eval_done;
-  // batch_done: Signals once all workers finished copying the eval result out of the batch, so that
-  // waiting workers can start fill new input data (strictly speaking it can be made more fine
-  // grained since there is no conflict between filling input with new data and copying output).
-  std::array<sem_t, BatchCopies> batch_done;
+    PyGILState_STATE gil = PyGILState_Ensure();
+    PyObject* result = call_py_eval<N>(eval, n, input_buffer.data());
+    PyArrayObject* policy_output = (PyArrayObject*)PyTuple_GetItem(result, 0);
+    PyArrayObject* value_output = (PyArrayObject*)PyTuple_GetItem(result, 1);
+    for (size_t i = 0; i < n; ++i) {
+      memcpy(priors[i].data(), PyArray_GETPTR2(policy_output, i, 0), sizeof(float) * TotalMoves);
+      values[i] = *(const float*)PyArray_GETPTR2(value_output, i, 0);
+    }
+    Py_XDECREF(result);
+    PyGILState_Release(gil);
+  }
+private:
+  PyObject* eval = nullptr;
+  std::vector<float> input_buffer;
 };
+
+using NetworkEvalBridge = BasicNetworkEvalBridge<go_engine::N>;
+using PyBatchEval = BasicPyBatchEval<go_engine::N>;
 }  // namespace mcts
 
 #endif // INCLUDE_GUARD_EVAL_BRIDGE_H__
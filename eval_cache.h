@@ -0,0 +1,115 @@
+// -*- mode:c++; c-basic-offset:2; coding:utf-8-unix -*-
+// ==================================================================================================
+#ifndef INCLUDE_GUARD_EVAL_CACHE_H__
+#define INCLUDE_GUARD_EVAL_CACHE_H__
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "board.h"
+#include "debug_msg.h"
+
+namespace mcts {
+
+// A fixed size, thread safe cache of eval results (policy and value), keyed by the Zobrist hash of
+// the board and the player to move, which is all the network sees.
+//
+// Entries are grouped in 2-way sets, a new entry replaces the one in its set not used most
+// recently.  Hash collisions are not detected beyond comparing the full 64 bit keys.
+template<unsigned N>
+class BasicEvalCache {
+  using BoardInfo = go_engine::BasicBoardInfo<N>;
+  static constexpr size_t TotalMoves = BoardInfo::TotalMoves;
+  static constexpr size_t Ways = 2;
+  static constexpr size_t LockCount = 256;
+  // Mixed into the key when white is to move.
+  static constexpr uint64_t WhiteToMove = 0x9e3779b97f4a7c15ULL;
+public:
+  // entries is rounded up to a multiple of the set size.
+  explicit BasicEvalCache(size_t entries)
+    : set_count(std::max<size_t>((entries + Ways - 1) / Ways, 1))
+    , sets(new Set[set_count])
+  {}
+
+  static uint64_t key(const BoardInfo& b) {
+    return b.get_hash() ^ (b.get_next_player() == go_engine::WHITE ? WhiteToMove : 0);
+  }
+
+  // Return true and fill prior / value if b is found.
+  bool lookup(const BoardInfo& b, std::array<float, TotalMoves>& prior, float& value) {
+    const uint64_t k = key(b);
+    const size_t i = k % set_count;
+    Set& set = sets[i];
+    {
+      std::lock_guard<std::mutex> lock(locks[i % LockCount]);
+      for (size_t w = 0; w < Ways; ++w) {
+        const Entry& e = set.entries[w];
+        if (e.used && e.key == k) {
+          prior = e.prior;
+          value = e.value;
+          set.recent = w;
+          hit_count.fetch_add(1, std::memory_order_relaxed);
+          return true;
+        }
+      }
+    }
+    miss_count.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  void insert(const BoardInfo& b, const std::array<float, TotalMoves>& prior, float value) {
+    const uint64_t k = key(b);
+    const size_t i = k % set_count;
+    Set& set = sets[i];
+    std::lock_guard<std::mutex> lock(locks[i % LockCount]);
+    size_t w = 0;
+    while (w < Ways && set.entries[w].used && set.entries[w].key != k) ++w;
+    if (w == Ways) {
+      w = (set.recent + 1) % Ways;
+    }
+    Entry& e = set.entries[w];
+    e.used = true;
+    e.key = k;
+    e.value = value;
+    e.prior = prior;
+    set.recent = w;
+  }
+
+  size_t size() const {
+    return set_count * Ways;
+  }
+  uint64_t hits() const {
+    return hit_count.load(std::memory_order_relaxed);
+  }
+  uint64_t misses() const {
+    return miss_count.load(std::memory_order_relaxed);
+  }
+private:
+  struct Entry {
+    bool used = false;
+    uint64_t key = 0;
+    float value = 0.0f;
+    std::array<float, TotalMoves> prior;
+  };
+  struct Set {
+    std::array<Entry, Ways> entries;
+    // The entry used most recently.
+    size_t recent = 0;
+  };
+
+  const size_t set_count;
+  std::unique_ptr<Set[]> sets;
+  // Set i is guarded by locks[i % LockCount].
+  std::array<std::mutex, LockCount> locks;
+  std::atomic<uint64_t> hit_count{0};
+  std::atomic<uint64_t> miss_count{0};
+};
+
+using EvalCache = BasicEvalCache<go_engine::N>;
+}  // namespace mcts
+
+#endif  // #ifndef INCLUDE_GUARD_EVAL_CACHE_H__
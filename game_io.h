@@ -0,0 +1,399 @@
+// -*- mode:c++; c-basic-offset:2; coding:utf-8-unix -*-
+// ==================================================================================================
+#ifndef INCLUDE_GUARD_GAME_IO_H__
+#define INCLUDE_GUARD_GAME_IO_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "batch_search.h"
+#include "board.h"
+#include "debug_msg.h"
+
+namespace mcts {
+
+// Binary format of self-play games, all integers are little endian.
+//
+// File:
+//   FileHeader
+//   Game record * game count
+//   Padding to a multiple of 8 bytes
+//   IndexEntry * game count
+//   IndexFooter
+//
+// Game record:
+//   GameHeader
+//   uint16_t moves[move_count]: move id, with the color in the highest bit (see encode_move()),
+//     padded with 0 to an even count.
+//   uint32_t entry_begin[move_count + 1]: search counts of move i are entries
+//     [entry_begin[i], entry_begin[i + 1]).
+//   CountEntry entries[entry_count]: search counts of each move, only non-zero ones are stored.
+//
+// Every part is 4 byte aligned (8 for the index), so that they can be used in place once the file
+// is mapped.  Version 1 files have no index, which is rebuilt by scanning all games when read.
+namespace game_io {
+constexpr char Magic[8] = {'M', 'C', 'T', 'S', 'G', 'A', 'M', 'E'};
+constexpr char IndexMagic[8] = {'M', 'C', 'T', 'S', 'I', 'N', 'D', 'X'};
+constexpr uint32_t Version = 2;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t board_size;
+  float komi;
+  uint32_t reserved;
+};
+static_assert(sizeof(FileHeader) == 24);
+
+struct GameHeader {
+  uint32_t move_count;
+  uint32_t entry_count;
+  // Black's score - White's score.
+  float score;
+  uint32_t reserved;
+};
+static_assert(sizeof(GameHeader) == 16);
+
+struct CountEntry {
+  uint16_t move;
+  // Saturates at 65535.
+  uint16_t count;
+};
+static_assert(sizeof(CountEntry) == 4);
+
+struct IndexEntry {
+  // File offset of the game record.
+  uint64_t offset;
+  // Number of positions (moves) in all games before this one.
+  uint64_t first_position;
+};
+static_assert(sizeof(IndexEntry) == 16);
+
+struct IndexFooter {
+  uint64_t game_count;
+  char magic[8];
+};
+static_assert(sizeof(IndexFooter) == 16);
+
+constexpr uint16_t WhiteBit = 0x8000;
+
+inline uint16_t encode_move(go_engine::Color color, unsigned id) {
+  return (uint16_t)id | (color == go_engine::WHITE ? WhiteBit : 0);
+}
+
+inline go_engine::Color move_color(uint16_t move) {
+  return move & WhiteBit ? go_engine::WHITE : go_engine::BLACK;
+}
+
+inline unsigned move_id(uint16_t move) {
+  return move & ~WhiteBit;
+}
+
+// Size in bytes of a game record with the given counts.
+inline size_t game_size(size_t move_count, size_t entry_count) {
+  return sizeof(GameHeader) + (move_count + move_count % 2) * sizeof(uint16_t) +
+    (move_count + 1) * sizeof(uint32_t) + entry_count * sizeof(CountEntry);
+}
+}  // namespace game_io
+
+// Appends games to a file in the format above.  The file is written under a temporary name, and the
+// index is appended and the file renamed when closed, so readers never see a partial file.
+//
+// Not thread safe.
+template<unsigned N>
+class BasicGameWriter {
+  using GameRecord = BasicGameRecord<N>;
+  static constexpr size_t TotalMoves = N * N + 1;
+public:
+  BasicGameWriter(const std::string& _filename, float komi)
+    : filename(_filename)
+    , tmp_filename(_filename + ".tmp")
+    , out(tmp_filename, std::ios::binary | std::ios::trunc)
+  {
+    game_io::FileHeader header{};
+    memcpy(header.magic, game_io::Magic, sizeof(header.magic));
+    header.version = game_io::Version;
+    header.board_size = N;
+    header.komi = komi;
+    out.write((const char*)&header, sizeof(header));
+  }
+
+  ~BasicGameWriter() {
+    close();
+  }
+  BasicGameWriter(const BasicGameWriter&) = delete;
+  BasicGameWriter& operator=(const BasicGameWriter&) = delete;
+
+  // False once any write has failed.
+  bool ok() const {
+    return out.good();
+  }
+
+  size_t game_count() const {
+    return count;
+  }
+
+  bool write(const GameRecord& g) {
+    ASSERT(g.moves.size() == g.search_count.size());
+    const size_t move_count = g.moves.size();
+    moves.assign(move_count + move_count % 2, 0);
+    entry_begin.clear();
+    entries.clear();
+    for (size_t i = 0; i < move_count; ++i) {
+      moves[i] = game_io::encode_move((go_engine::Color)g.moves[i].color, g.moves[i].id());
+      entry_begin.push_back(entries.size());
+      for (size_t m = 0; m < TotalMoves; ++m) {
+        if (g.search_count[i][m] > 0) {
+          entries.push_back({(uint16_t)m, (uint16_t)std::min(g.search_count[i][m], 0xffffU)});
+        }
+      }
+    }
+    entry_begin.push_back(entries.size());
+
+    index.push_back({offset, position_count});
+    offset += game_io::game_size(move_count, entries.size());
+    position_count += move_count;
+
+    game_io::GameHeader header{};
+    header.move_count = move_count;
+    header.entry_count = entries.size();
+    header.score = g.score;
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)moves.data(), moves.size() * sizeof(uint16_t));
+    out.write((const char*)entry_begin.data(), entry_begin.size() * sizeof(uint32_t));
+    out.write((const char*)entries.data(), entries.size() * sizeof(game_io::CountEntry));
+    // Games are streamed to the file, rather than accumulated in memory.
+    out.flush();
+    ++count;
+    return ok();
+  }
+
+  // Finish the file and move it to its final name.  Return false if any write has failed, in which
+  // case the temporary file is removed instead.
+  bool close() {
+    if (!out.is_open()) return closed_ok;
+    game_io::IndexFooter footer{};
+    footer.game_count = index.size();
+    memcpy(footer.magic, game_io::IndexMagic, sizeof(footer.magic));
+    const uint32_t padding = 0;
+    out.write((const char*)&padding, offset % sizeof(uint64_t));
+    out.write((const char*)index.data(), index.size() * sizeof(game_io::IndexEntry));
+    out.write((const char*)&footer, sizeof(footer));
+    out.close();
+    closed_ok = !out.fail() && std::rename(tmp_filename.c_str(), filename.c_str()) == 0;
+    if (!closed_ok) {
+      std::remove(tmp_filename.c_str());
+    }
+    return closed_ok;
+  }
+private:
+  const std::string filename;
+  const std::string tmp_filename;
+  std::ofstream out;
+  size_t count = 0;
+  bool closed_ok = false;
+  // Offset of the next game, and the index of games written so far.
+  uint64_t offset = sizeof(game_io::FileHeader);
+  uint64_t position_count = 0;
+  std::vector<game_io::IndexEntry> index;
+  // Buffers reused across games.
+  std::vector<uint16_t> moves;
+  std::vector<uint32_t> entry_begin;
+  std::vector<game_io::CountEntry> entries;
+};
+
+using GameWriter = BasicGameWriter<go_engine::N>;
+
+// Read-only view of a file written by GameWriter.  The file is mapped into memory, and games are
+// located with the index, so any game or position is read without parsing the rest of the file.
+//
+// The board size is read from the file, so this is not a template.  Thread safe.
+class GameReader {
+public:
+  // A game record in place in the mapped file, valid as long as the reader.
+  struct GameView {
+    const game_io::GameHeader* header;
+    const uint16_t* moves;
+    const uint32_t* entry_begin;
+    const game_io::CountEntry* entries;
+  };
+
+  explicit GameReader(const std::string& filename) {
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(game_io::FileHeader)) {
+      size = st.st_size;
+      void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED) {
+        data = (const char*)p;
+      }
+    }
+    ::close(fd);
+    if (data != nullptr) {
+      valid = read_index();
+    }
+  }
+
+  ~GameReader() {
+    if (data != nullptr) {
+      munmap((void*)data, size);
+    }
+  }
+  GameReader(const GameReader&) = delete;
+  GameReader& operator=(const GameReader&) = delete;
+
+  // False if the file can't be read or is not a valid game file.
+  bool ok() const {
+    return valid;
+  }
+
+  unsigned board_size() const {
+    return file_header()->board_size;
+  }
+  float komi() const {
+    return file_header()->komi;
+  }
+  size_t game_count() const {
+    return game_total;
+  }
+  size_t position_count() const {
+    return position_total;
+  }
+
+  // Return false if game i is corrupted.
+  bool game(size_t i, GameView* view) const {
+    ASSERT(i < game_total) << i << " >= " << game_total;
+    const uint64_t offset = index[i].offset;
+    if (offset + sizeof(game_io::GameHeader) > games_end) return false;
+    const auto* header = (const game_io::GameHeader*)(data + offset);
+    const size_t move_count = header->move_count;
+    if (move_count > (games_end - offset) / sizeof(uint32_t) ||
+        offset + game_io::game_size(move_count, header->entry_count) > games_end) {
+      return false;
+    }
+    view->header = header;
+    view->moves = (const uint16_t*)(header + 1);
+    view->entry_begin = (const uint32_t*)(view->moves + move_count + move_count % 2);
+    view->entries = (const game_io::CountEntry*)(view->entry_begin + move_count + 1);
+    // Entries of each move must be within those of the game, so that views can be used as is.
+    for (size_t k = 0; k < move_count; ++k) {
+      if (view->entry_begin[k] > view->entry_begin[k + 1]) return false;
+    }
+    return view->entry_begin[move_count] == header->entry_count;
+  }
+
+  // Return (game, move) of position j, where positions are numbered across all games in order.
+  std::pair<size_t, size_t> locate(size_t j) const {
+    ASSERT(j < position_total) << j << " >= " << position_total;
+    const game_io::IndexEntry* it =
+      std::upper_bound(index, index + game_total, (uint64_t)j,
+                       [](uint64_t p, const game_io::IndexEntry& e) { return p < e.first_position; });
+    const size_t i = it - index - 1;
+    return {i, j - index[i].first_position};
+  }
+
+  // Decode game i, which must be a game of size N.  Return false if it is corrupted.
+  template<unsigned N>
+  bool read(size_t i, BasicGameRecord<N>* g) const {
+    CHECK(board_size() == N) << board_size() << " != " << N;
+    GameView view;
+    if (!game(i, &view)) return false;
+    const size_t move_count = view.header->move_count;
+    g->moves.clear();
+    g->search_count.assign(move_count, {});
+    for (size_t k = 0; k < move_count; ++k) {
+      const unsigned id = game_io::move_id(view.moves[k]);
+      if (id > N * N) return false;
+      g->moves.emplace_back(game_io::move_color(view.moves[k]), id);
+      for (uint32_t e = view.entry_begin[k]; e < view.entry_begin[k + 1]; ++e) {
+        if (view.entries[e].move > N * N) return false;
+        g->search_count[k][view.entries[e].move] = view.entries[e].count;
+      }
+    }
+    g->score = view.header->score;
+    return true;
+  }
+private:
+  const game_io::FileHeader* file_header() const {
+    return (const game_io::FileHeader*)data;
+  }
+
+  bool read_index() {
+    const game_io::FileHeader* header = file_header();
+    if (memcmp(header->magic, game_io::Magic, sizeof(header->magic)) != 0) return false;
+    if (header->version == 1) {
+      return scan_games();
+    }
+    if (header->version != game_io::Version || size < sizeof(game_io::FileHeader) + sizeof(game_io::IndexFooter)) {
+      return false;
+    }
+    const auto* footer = (const game_io::IndexFooter*)(data + size - sizeof(game_io::IndexFooter));
+    if (memcmp(footer->magic, game_io::IndexMagic, sizeof(footer->magic)) != 0) return false;
+    const size_t index_size = size - sizeof(game_io::FileHeader) - sizeof(game_io::IndexFooter);
+    if (footer->game_count > index_size / sizeof(game_io::IndexEntry)) return false;
+    game_total = footer->game_count;
+    games_end = size - sizeof(game_io::IndexFooter) - game_total * sizeof(game_io::IndexEntry);
+    index = (const game_io::IndexEntry*)(data + games_end);
+    // Positions must be numbered from 0 without gaps, as locate() relies on it.
+    uint64_t positions = 0;
+    for (size_t i = 0; i < game_total; ++i) {
+      if (index[i].offset < sizeof(game_io::FileHeader) || index[i].offset > games_end - sizeof(game_io::GameHeader) ||
+          (i > 0 && index[i].offset <= index[i - 1].offset) || index[i].first_position != positions) {
+        return false;
+      }
+      positions += ((const game_io::GameHeader*)(data + index[i].offset))->move_count;
+    }
+    if (game_total > 0) {
+      GameView last;
+      if (!game(game_total - 1, &last)) return false;
+    }
+    position_total = positions;
+    return true;
+  }
+
+  // Build the index of a file without one.
+  bool scan_games() {
+    games_end = size;
+    uint64_t offset = sizeof(game_io::FileHeader);
+    uint64_t positions = 0;
+    while (offset < size) {
+      if (offset + sizeof(game_io::GameHeader) > size) return false;
+      const auto* header = (const game_io::GameHeader*)(data + offset);
+      const size_t game_size = game_io::game_size(header->move_count, header->entry_count);
+      if (game_size > size - offset) return false;
+      scanned_index.push_back({offset, positions});
+      offset += game_size;
+      positions += header->move_count;
+    }
+    index = scanned_index.data();
+    game_total = scanned_index.size();
+    position_total = positions;
+    return true;
+  }
+
+  const char* data = nullptr;
+  size_t size = 0;
+  bool valid = false;
+  // End of game records, where the index starts.
+  size_t games_end = 0;
+  const game_io::IndexEntry* index = nullptr;
+  // Only used for files without an index.
+  std::vector<game_io::IndexEntry> scanned_index;
+  size_t game_total = 0;
+  size_t position_total = 0;
+};
+}  // namespace mcts
+
+#endif  // #ifndef INCLUDE_GUARD_GAME_IO_H__
@@ -68,53 +68,50 @@ def play_one_game(players, debug_log):
         print("Score = {}, {}.".format(players[0].score(), players[1].score()))
 
 
+# Number of search threads of the engine, which evaluate boards in batches of up to this size.
+SEARCH_THREADS = 8
+# The engine keeps searching while waiting for your move, up to this many simulations.
+PONDER_SIMULATIONS = 200000
+
 class WorkerThread(threading.Thread):
-    def __init__(self, thread_id, eval_object):
+    def __init__(self, eval_object):
         super().__init__()
         self.daemon = True
-        self.thread_id = thread_id
         self.eval_object = eval_object
 
     def run(self):
-        players = None
-        if self.thread_id == 0:
-            while True:
-                print(f'Play black (B) or white (W)?')
-                color = input()
-                if color in ('B', 'W'):
-                    break
-                else:
-                    print('Invalid color.')
-            if color == 'B':
-                players = (InteractivePlayer(komi=7.5, color=0),
-                           mcts.Tree(komi=7.5, color=1, eval=self.eval_object))
+        while True:
+            print(f'Play black (B) or white (W)?')
+            color = input()
+            if color in ('B', 'W'):
+                break
             else:
-                players = (mcts.Tree(komi=7.5, color=0, eval=self.eval_object),
-                           InteractivePlayer(komi=7.5, color=1))
+                print('Invalid color.')
+        if color == 'B':
+            players = (InteractivePlayer(komi=7.5, color=0),
+                       mcts.Tree(komi=7.5, color=1, eval=self.eval_object, threads=SEARCH_THREADS,
+                                 ponder=PONDER_SIMULATIONS))
         else:
-            # All other threads are fillers since eval bridge requires multiple threads to fill each
-            # batch.
-            players = (mcts.Tree(komi=7.5, color=0, eval=self.eval_object),
-                       mcts.Tree(komi=7.5, color=1, eval=self.eval_object))
+            players = (mcts.Tree(komi=7.5, color=0, eval=self.eval_object, threads=SEARCH_THREADS,
+                                 ponder=PONDER_SIMULATIONS),
+                       InteractivePlayer(komi=7.5, color=1))
         while True:
-            play_one_game(players, self.thread_id == 0)
-            if self.thread_id == 0:
-                if isinstance(players[0], mcts.Tree):
-                    score = players[0].score()
-                else:
-                    score = -players[1].score()
-                print(f'Score: B = {score}, W = {-score}.')
+            play_one_game(players, True)
+            if isinstance(players[0], mcts.Tree):
+                score = players[0].score()
+            else:
+                score = -players[1].score()
+            print(f'Score: B = {score}, W = {-score}.')
             [p.reset() for p in players]
 
 gpu_options = tf.GPUOptions(per_process_gpu_memory_fraction=0.05)
 sess = tf.Session(config=tf.ConfigProto(gpu_options=gpu_options))
 
 network = Network()
-eval_object = mcts.EvalBridge(network.eval)
+# Partial batches are sent right away, a single game doesn't wait for other requests.
+eval_object = mcts.EvalBridge(network.eval, batch_size=SEARCH_THREADS, max_wait=0)
 
-worker_threads = [WorkerThread(i, eval_object) for i in range(eval_object.worker_thread_count())]
-for w in worker_threads:
-    w.start()
+WorkerThread(eval_object).start()
 
 # The following is an infinite loop.
 #
@@ -3,33 +3,296 @@
 #ifndef INCLUDE_GUARD_MCTS_H__
 #define INCLUDE_GUARD_MCTS_H__
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <math.h>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include <type_traits>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "config.h"
 #include "debug_msg.h"
 #include "board.h"
+#include "opening_book.h"
 
 namespace mcts {
 
-using go_engine::TotalMoves;
+// Search statistics of a single edge (a move from a node) of the search tree.
+struct EdgeStats {
+  unsigned count;
+  float value;
+  unsigned child;
+};
+static_assert(sizeof(EdgeStats) == 12);
+
+// Deleter of arrays allocated by new[], or borrowed from a mapped tree snapshot and never deleted.
+template<typename T>
+struct ArrayDeleter {
+  bool owned = true;
+  void operator()(T* p) const {
+    if (owned) delete[] p;
+  }
+};
+
+// A node of the search tree.  Only the legal moves found when the node is created are stored
+// (packed as move ids and 16 bit fixed point priors), sorted by prior in descending order.
+//
+// All unvisited edges have the same initial value in the PUCT formula, so among them the one with
+// the highest prior is always picked first.  This means edges are always visited for the first time
+// in the order they are stored, hence only a prefix of them needs search statistics, and this
+// prefix is grown lazily.  Most nodes in a tree are leaves which never carry any statistics.
+class Node {
+  static constexpr float PriorScale = 65535.0f;
+public:
+  static constexpr unsigned Unexplored = static_cast<unsigned>(-1);
+  // The child is being created by another search thread.
+  static constexpr unsigned Pending = Unexplored - 1;
+
+  // An empty placeholder, only used by NodePool.
+  Node() = default;
+
+  // Priors are indexed by move id, only those of legal moves in b are kept.
+  template<unsigned N>
+  Node(const go_engine::BasicBoardInfo<N>& b, const std::array<float, N * N + 1>& p, float score)
+    : total_count(0)
+    , prior_score(score)
+  {
+    constexpr size_t TotalMoves = N * N + 1;
+    const std::bitset<TotalMoves> valid = b.legal_moves();
+    std::array<uint16_t, TotalMoves> legal;
+    for (unsigned m = 0; m < TotalMoves; ++m) {
+      if (valid[m]) {
+        legal[edge_count++] = m;
+      }
+    }
+    // Note that pass is always a valid move.
+    ASSERT(edge_count > 0) << b.DebugString();
+    std::stable_sort(legal.begin(), legal.begin() + edge_count,
+                     [&p](uint16_t a, uint16_t b) { return p[a] > p[b]; });
+    edges.reset(new uint16_t[2 * edge_count]);
+    for (unsigned i = 0; i < edge_count; ++i) {
+      edges[i] = legal[i];
+      edges[edge_count + i] = std::lround(std::clamp(p[legal[i]], 0.0f, 1.0f) * PriorScale);
+    }
+  }
+
+  // A node of a mapped tree snapshot, which uses packed edges (see below) and stats in place.
+  Node(const uint16_t* _edges, unsigned _edge_count, EdgeStats* _stats, unsigned _expanded_count,
+       unsigned _total_count, float score)
+    : total_count(_total_count)
+    , prior_score(score)
+    , edges(const_cast<uint16_t*>(_edges), ArrayDeleter<uint16_t>{false})
+    , stats(_stats, ArrayDeleter<EdgeStats>{false})
+    , edge_count(_edge_count)
+    , expanded_count(_expanded_count)
+    , capacity(_expanded_count)
+  {}
+
+  // Number of legal moves.
+  unsigned size() const {
+    return edge_count;
+  }
+
+  // Move ids of all edges followed by their priors, as stored.
+  const uint16_t* packed_edges() const {
+    return edges.get();
+  }
+
+  // Number of edges carrying search statistics, all edges beyond this are unvisited.
+  unsigned expanded() const {
+    return expanded_count;
+  }
+
+  unsigned move(unsigned i) const {
+    ASSERT(i < edge_count) << i << " >= " << edge_count;
+    return edges[i];
+  }
+
+  float prior(unsigned i) const {
+    ASSERT(i < edge_count) << i << " >= " << edge_count;
+    return edges[edge_count + i] * (1.0f / PriorScale);
+  }
+
+  unsigned count(unsigned i) const {
+    return i < expanded_count ? stats[i].count : 0;
+  }
+
+  // Average value of an edge, unvisited edges are assumed to be even.
+  float value(unsigned i) const {
+    const unsigned n = count(i);
+    return n == 0 ? 0.5f : stats[i].value / static_cast<float>(n);
+  }
 
-struct Node {
-  // TODO: Some fields can be lazily allocated to save memory.
-  std::array<float, TotalMoves> prior;
-  std::array<unsigned, TotalMoves> count;
-  std::array<float, TotalMoves> value;
-  std::array<unsigned, TotalMoves> child;
-  unsigned total_count;
+  const EdgeStats& edge(unsigned i) const {
+    ASSERT(i < expanded_count) << i << " >= " << expanded_count;
+    return stats[i];
+  }
+  EdgeStats& edge(unsigned i) {
+    ASSERT(i < expanded_count) << i << " >= " << expanded_count;
+    return stats[i];
+  }
+
+  // Make sure edge i carries search statistics and return them.  The returned reference stays
+  // valid when the node itself is moved, but not after another call to expand().
+  EdgeStats& expand(unsigned i) {
+    ASSERT(i < edge_count) << i << " >= " << edge_count;
+    if (i >= expanded_count) {
+      if (i >= capacity) {
+        unsigned new_capacity = std::max(capacity * 2U, 4U);
+        while (new_capacity <= i) new_capacity *= 2;
+        new_capacity = std::min<unsigned>(new_capacity, edge_count);
+        std::unique_ptr<EdgeStats[], ArrayDeleter<EdgeStats>> s(new EdgeStats[new_capacity]);
+        std::copy(stats.get(), stats.get() + expanded_count, s.get());
+        stats = std::move(s);
+        capacity = new_capacity;
+      }
+      for (unsigned j = expanded_count; j <= i; ++j) {
+        stats[j] = {0, 0.0f, Unexplored};
+      }
+      expanded_count = i + 1;
+    }
+    return stats[i];
+  }
+
+  // Return the index of the edge for move m, or size() if m is not a legal move.
+  unsigned find(unsigned m) const {
+    for (unsigned i = 0; i < edge_count; ++i) {
+      if (edges[i] == m) return i;
+    }
+    return edge_count;
+  }
+
+  unsigned total_count = 0;
   // score from value network.
-  float prior_score;
+  float prior_score = 0.0f;
+private:
+  // edges[0, edge_count): move ids, edges[edge_count, 2 * edge_count): priors.  Never written once
+  // the node is created.
+  std::unique_ptr<uint16_t[], ArrayDeleter<uint16_t>> edges;
+  std::unique_ptr<EdgeStats[], ArrayDeleter<EdgeStats>> stats;
+  uint16_t edge_count = 0;
+  uint16_t expanded_count = 0;
+  uint16_t capacity = 0;
+};
+
+// Storage of all nodes of a search tree.  Nodes are kept in chunks of geometrically increasing
+// sizes and are never moved once added, so search threads can keep references to nodes while
+// other threads are adding new ones.
+class NodePool {
+  static constexpr unsigned LogFirstChunk = 10;
+  static constexpr unsigned MaxChunks = 32;
+public:
+  NodePool() = default;
+  NodePool(const NodePool&) = delete;
+  NodePool& operator=(const NodePool&) = delete;
+
+  ~NodePool() {
+    clear();
+  }
+
+  // Number of nodes added so far, including those still being constructed by other threads.
+  size_t size() const {
+    return count.load(std::memory_order_acquire);
+  }
+
+  Node& operator[](size_t i) {
+    const auto [k, offset] = locate(i);
+    return chunks[k].load(std::memory_order_acquire)[offset];
+  }
+  const Node& operator[](size_t i) const {
+    const auto [k, offset] = locate(i);
+    return chunks[k].load(std::memory_order_acquire)[offset];
+  }
+
+  // Add a node and return its index.  Thread safe, but other threads must not access the new node
+  // until its index is published to them.
+  size_t push_back(Node&& node) {
+    const size_t i = count.fetch_add(1, std::memory_order_acq_rel);
+    const auto [k, offset] = locate(i);
+    Node* chunk = chunks[k].load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+      std::lock_guard<std::mutex> lock(grow_mutex);
+      chunk = chunks[k].load(std::memory_order_relaxed);
+      if (chunk == nullptr) {
+        chunk = new Node[size_t(1) << (LogFirstChunk + k)];
+        chunks[k].store(chunk, std::memory_order_release);
+      }
+    }
+    chunk[offset] = std::move(node);
+    return i;
+  }
+
+  // Not thread safe.
+  void clear() {
+    for (auto& chunk : chunks) {
+      delete[] chunk.load(std::memory_order_relaxed);
+      chunk.store(nullptr, std::memory_order_relaxed);
+    }
+    count.store(0, std::memory_order_relaxed);
+  }
+
+  // Not thread safe.
+  void swap(NodePool& other) {
+    for (unsigned k = 0; k < MaxChunks; ++k) {
+      Node* t = chunks[k].load(std::memory_order_relaxed);
+      chunks[k].store(other.chunks[k].load(std::memory_order_relaxed), std::memory_order_relaxed);
+      other.chunks[k].store(t, std::memory_order_relaxed);
+    }
+    size_t t = count.load(std::memory_order_relaxed);
+    count.store(other.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    other.count.store(t, std::memory_order_relaxed);
+  }
+private:
+  // Chunk k holds 2^(LogFirstChunk + k) nodes, starting from index (2^k - 1) * 2^LogFirstChunk.
+  static std::pair<unsigned, size_t> locate(size_t i) {
+    const size_t j = (i >> LogFirstChunk) + 1;
+    const unsigned k = 63 - __builtin_clzll(j);
+    ASSERT(k < MaxChunks) << i;
+    return {k, i - (((size_t(1) << k) - 1) << LogFirstChunk)};
+  }
+
+  std::array<std::atomic<Node*>, MaxChunks> chunks{};
+  std::atomic<size_t> count{0};
+  std::mutex grow_mutex;
+};
+
+// A minimal spin lock, critical sections protected by it are expected to be very short.
+class SpinLock {
+public:
+  void lock() {
+    while (locked.exchange(true, std::memory_order_acquire)) {
+      while (locked.load(std::memory_order_relaxed)) {
+        std::this_thread::yield();
+      }
+    }
+  }
+  void unlock() {
+    locked.store(false, std::memory_order_release);
+  }
+private:
+  std::atomic<bool> locked{false};
 };
 
 template<size_t N>
@@ -60,80 +323,376 @@ private:
   std::gamma_distribution<float> gamma;
 };
 
-template<typename EvalEngine>
-class Tree {
-  static_assert(std::is_same<float, decltype(std::declval<EvalEngine>()(std::declval<const go_engine::BoardInfo&>(),
+// Maps game states (see BoardInfo::get_state_hash()) to nodes, so that states reached by different
+// move orders share one node.  Thread safe.
+//
+// Limitation: a node only has the moves legal on the path it's created from.  A move forbidden by
+// superko there but legal on another path reaching the node is never searched from it; only play()
+// handles such a move, by starting a new root.
+class TranspositionTable {
+public:
+  // Return the node of state key, or Node::Unexplored.
+  unsigned find(uint64_t key) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = map.find(key);
+    return it == map.end() ? Node::Unexplored : it->second;
+  }
+
+  // Map key to node unless it's already mapped, and return the node key is mapped to.
+  unsigned insert(uint64_t key, unsigned node) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return map.emplace(key, node).first->second;
+  }
+
+  // Renumber nodes, new_id[n] is the new id of node n, or Node::Unexplored if it's dropped.
+  void renumber(const std::vector<unsigned>& new_id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = map.begin(); it != map.end();) {
+      ASSERT(it->second < new_id.size()) << it->second;
+      if (new_id[it->second] == Node::Unexplored) {
+        it = map.erase(it);
+      } else {
+        it->second = new_id[it->second];
+        ++it;
+      }
+    }
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    map.clear();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return map.size();
+  }
+private:
+  mutable std::mutex mutex;
+  std::unordered_map<uint64_t, unsigned> map;
+};
+
+// Limits of the search for a move, which stops at the first one reached.
+struct SearchBudget {
+  // Number of simulations.
+  size_t simulations = 1000;
+  // Wall clock time, unlimited if 0.
+  std::chrono::microseconds time{0};
+  // Number of nodes of the tree, including those kept from previous moves, unlimited if 0.
+  size_t nodes = 0;
+  // Stop once the most searched move can't be overtaken by the simulations left (estimated from the
+  // rate so far for time).  This changes search counts of other moves, not the most searched one.
+  bool early_stop = false;
+};
+
+// Why a search stopped.  Only pondering is Stopped, by Tree::stop_pondering().  Book means the move
+// was taken from the opening book without searching.
+enum class SearchStop { Simulations, Time, Nodes, Decided, Stopped, Book };
+
+// Statistics of a search for a move.
+struct SearchStats {
+  // Simulations done, not counting the one creating the root.
+  size_t simulations = 0;
+  std::chrono::microseconds time{0};
+  // Nodes of the tree at the end.
+  size_t nodes = 0;
+  SearchStop stop = SearchStop::Simulations;
+};
+
+struct SearchOptions {
+  // Number of threads searching a tree concurrently in Tree::gen_play(), EvalEngine must be thread
+  // safe if this is more than 1.
+  unsigned threads = 1;
+  // Share nodes between transpositions, which turns the tree into a DAG.
+  bool transpositions = false;
+  SearchBudget budget;
+  // Budget of pondering (see Tree::ponder()), which is started by Tree::play() when the opponent is
+  // to move, unless simulations is 0.  early_stop is ignored.
+  SearchBudget ponder = {0};
+  // Positions found in this book (of the same board size and komi) are played by Tree::gen_play()
+  // from the book counts, without searching.
+  std::shared_ptr<const OpeningBook> book;
+};
+
+// Result of Tree::start_simulation().
+enum class SimulationState {
+  // The simulation reached a terminal state and has been backed up.
+  Done,
+  // The simulation reached a new state, which must be evaluated and passed to finish_simulation().
+  NeedEval,
+  // The simulation reached a state being evaluated for another simulation, and has been reverted.
+  Abandoned,
+};
+
+// Binary format of search tree snapshots written by Tree::save(), all integers are little endian.
+//
+// File:
+//   FileHeader
+//   uint16_t history[history_length]: ids of the moves played from the empty board, padded with 0
+//     to a multiple of 4.
+//   NodeRecord nodes[node_count]: node 0 is the root.
+//   uint16_t edges[edge_count]: packed edges of all nodes (see Node), padded with 0 to an even count.
+//   EdgeStats stats[stats_count]: search statistics of expanded edges of all nodes, children are
+//     node indices.
+//
+// Every part is aligned, so that edges and statistics are used in place once the file is mapped.
+namespace tree_io {
+constexpr char Magic[8] = {'M', 'C', 'T', 'S', 'T', 'R', 'E', 'E'};
+constexpr uint32_t Version = 1;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t board_size;
+  float komi;
+  uint32_t history_length;
+  uint64_t node_count;
+  uint64_t edge_count;
+  uint64_t stats_count;
+};
+static_assert(sizeof(FileHeader) == 48);
+
+struct NodeRecord {
+  // Index of the first of 2 * size packed edges, and of the first of expanded stats.
+  uint64_t edge_begin;
+  uint64_t stats_begin;
+  uint32_t total_count;
+  float prior_score;
+  uint16_t size;
+  uint16_t expanded;
+  uint32_t reserved;
+};
+static_assert(sizeof(NodeRecord) == 32);
+
+// A private (copy on write) writable mapping of a whole file.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& filename) {
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        base = (char*)p;
+        size = st.st_size;
+      }
+    }
+    ::close(fd);
+  }
+
+  ~MappedFile() {
+    if (base != nullptr) munmap(base, size);
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  char* base = nullptr;
+  size_t size = 0;
+};
+}  // namespace tree_io
+
+// Search tree for boards of size N.  EvalEngine is called as eval(board, prior) and returns the
+// value of board, see NetworkEvalBridge.
+template<unsigned N, typename EvalEngine>
+class BasicTree {
+public:
+  using BoardInfo = go_engine::BasicBoardInfo<N>;
+  using Move = go_engine::BasicMove<N>;
+  using Clock = std::chrono::steady_clock;
+  static constexpr size_t TotalMoves = BoardInfo::TotalMoves;
+private:
+  static_assert(std::is_same<float, decltype(std::declval<EvalEngine>()(std::declval<const BoardInfo&>(),
                                                                         std::declval<std::array<float, TotalMoves>&>()))>::value,
                 "Invalid EvalEngine.");
-  static constexpr unsigned Unexplored = static_cast<unsigned>(-1);
+  static constexpr unsigned Unexplored = Node::Unexplored;
+  static constexpr unsigned Pending = Node::Pending;
+  // Value of id when no node has been created for the current game state yet.
+  static constexpr size_t NoRoot = static_cast<size_t>(-1);
 public:
+  // A simulation suspended at a state waiting for eval, see start_simulation().
+  struct Simulation {
+    // (node, edge) pairs from the root down to the new state.
+    std::vector<std::pair<size_t, unsigned>> path;
+    // The new state.
+    std::optional<BoardInfo> board;
+    // Game state (see Tree::generation) board is duplicated from.  The next simulation reverts board
+    // to it with undo() instead of duplicating it again, unless the game state has changed since.
+    size_t generation = 0;
+  };
+
+  // The node of the current game state is created lazily by the first simulation, so neither the
+  // constructor nor play() calls EvalEngine.
   template<typename T>
-  Tree(float komi, go_engine::Color c, T&& _eval)
-    :board(komi), color(c), id(0)
+  BasicTree(float komi, go_engine::Color c, T&& _eval, const SearchOptions& options = {})
+    :board(komi), color(c), id(NoRoot)
     , eval(std::forward<T>(_eval))
+    , search_threads(std::max(options.threads, 1U))
+    , budget(options.budget)
+    , book(options.book)
+    , ponder_budget(options.ponder)
+    , transpositions(options.transpositions ? new TranspositionTable : nullptr)
     , engine(std::random_device()())
     , dir(1.03f)
   {
-    init_node(board);
+    ponder_budget.early_stop = false;
+    CHECK(book == nullptr || (book->ok() && book->board_size() == N && book->komi() == komi));
+  }
+
+  ~BasicTree() {
+    stop_pondering();
   }
 
   void reset() {
+    stop_pondering();
     board.reset();
-    id = 0;
+    ++generation;
+    id = NoRoot;
+    book_count.reset();
     states.clear();
+    snapshot.reset();
+    if (transpositions) transpositions->clear();
     history.clear();
-    init_node(board);
   }
 
-  const std::array<unsigned, go_engine::TotalMoves>& get_search_count() const {
+  // Search count of all moves (indexed by move id) of the current game state, or its book counts
+  // if gen_play() took the move from the book.  Stops pondering.
+  std::array<unsigned, TotalMoves> get_search_count() {
+    stop_pondering();
+    if (book_count) return *book_count;
+    std::array<unsigned, TotalMoves> count{};
+    if (id == NoRoot) return count;
     ASSERT(id < states.size()) << id << " >= " << states.size();
-    return states[id].count;
+    const Node& node = states[id];
+    for (unsigned i = 0; i < node.expanded(); ++i) {
+      if (is_valid_edge(node, i)) {
+        count[node.move(i)] = node.edge(i).count;
+      }
+    }
+    return count;
   }
 
-  go_engine::Move gen_play(bool debug_log) {
+  // Search within the budget of SearchOptions, or the one given, and pick a move.
+  Move gen_play(bool debug_log) {
+    return gen_play(debug_log, budget);
+  }
+
+  Move gen_play(bool debug_log, const SearchBudget& search_budget) {
+    stop_pondering();
     CHECK(!board.finished()) << board.DebugString();
     CHECK(board.get_next_player() == color);
-    ASSERT(id < states.size()) << id << " >= " << states.size();
-    for (size_t i = 0; i < SearchCount; ++i) {
-      search_from(id, false);
+    book_count.reset();
+    if (book != nullptr) {
+      if (const auto move = book_move(debug_log)) {
+        stats = SearchStats();
+        stats.nodes = states.size();
+        stats.stop = SearchStop::Book;
+        return *move;
+      }
     }
+    stats = run_search(search_budget, nullptr);
+    return select_move(debug_log);
+  }
+
+  // Statistics of the last search of gen_play().
+  const SearchStats& search_stats() const {
+    return stats;
+  }
+
+  // Keep searching the current game state in the background within the pondering budget of
+  // SearchOptions, or the one given, until it runs out or any of play(), gen_play(), reset() or
+  // stop_pondering() is called.  Search statistics are kept by play() for the subtree of the move
+  // played.  Other member functions must not be called meanwhile, except finished(), score(),
+  // is_valid() and pondering(), unless they stop pondering.  Does nothing if already pondering.
+  void ponder() {
+    ponder(ponder_budget);
+  }
+
+  void ponder(const SearchBudget& search_budget) {
+    CHECK(!board.finished()) << board.DebugString();
+    if (pondering()) return;
+    // Joins the thread of a previous search which ran out of budget.
+    stop_pondering();
+    ponder_cancel.store(false, std::memory_order_relaxed);
+    ponder_running.store(true, std::memory_order_relaxed);
+    ponder_thread = std::thread([this, search_budget]() {
+        ponder_result = run_search(search_budget, &ponder_cancel);
+        ponder_running.store(false, std::memory_order_release);
+      });
+  }
+
+  // Wait for pondering to stop, and return its statistics.
+  const SearchStats& stop_pondering() {
+    if (ponder_thread.joinable()) {
+      ponder_cancel.store(true, std::memory_order_relaxed);
+      ponder_thread.join();
+    }
+    return ponder_result;
+  }
+
+  // Whether a pondering search is running, which is no longer the case once its budget runs out.
+  bool pondering() const {
+    return ponder_running.load(std::memory_order_acquire);
+  }
 
+  // Return why a search of the current game state should stop, if it should.  It has completed
+  // simulations since start, and up to in_flight more are running.
+  std::optional<SearchStop> search_limit(const SearchBudget& search_budget, size_t simulations, Clock::time_point start,
+                                         unsigned in_flight = 0) {
+    if (simulations >= search_budget.simulations) return SearchStop::Simulations;
+    double remaining = search_budget.simulations - simulations;
+    if (search_budget.time.count() > 0) {
+      const auto elapsed = Clock::now() - start;
+      if (elapsed >= search_budget.time) return SearchStop::Time;
+      if (simulations > 0) {
+        remaining = std::min(remaining, simulations * std::chrono::duration<double>(search_budget.time - elapsed) /
+                             std::chrono::duration<double>(elapsed));
+      }
+    }
+    if (search_budget.nodes > 0 && states.size() >= search_budget.nodes) return SearchStop::Nodes;
+    // Simulations in flight hold virtual losses.
+    if (search_budget.early_stop && search_decided((size_t)std::ceil(remaining) + in_flight * VirtualLoss)) {
+      return SearchStop::Decided;
+    }
+    return std::nullopt;
+  }
+
+  // Pick a move according to search counts of the current game state, without searching.
+  Move select_move(bool debug_log) {
+    CHECK(!board.finished()) << board.DebugString();
+    CHECK(board.get_next_player() == color);
+    ASSERT(id < states.size()) << id << " >= " << states.size();
     float sum = 0.0f;
     const Node& node = states[id];
+    // Indexed by edge, not by move id.
     std::array<float, TotalMoves> p;
-    const float inv_temp = history.size() < go_engine::N ? 1.0f : 5.0f;
-    for (size_t m = 0; m < TotalMoves; ++m) {
-      if (node.prior[m] < 0.0f) {
-        continue;  // Invalid moves.
-      }
-      p[m] = std::pow(node.count[m], inv_temp);
-      sum += p[m];
+    const float inv_temp = inverse_temperature();
+    for (unsigned i = 0; i < node.size(); ++i) {
+      p[i] = is_valid_edge(node, i) ? std::pow(node.count(i), inv_temp) : 0.0f;
+      sum += p[i];
     }
 
     LOG(debug_log) << board.DebugString();
     if (debug_log) {
-      for (size_t m = 0; m < TotalMoves; ++m) {
-        if (node.prior[m] < 0.0f) continue;  // Invalid moves.
-        go_engine::Move move(color, m);
+      for (unsigned i = 0; i < node.size(); ++i) {
+        Move move(color, node.move(i));
         LOG(debug_log)
           << "    " << move.DebugString()
-          << ": prior = " << std::fixed << std::setprecision(4) << std::setfill(' ') << node.prior[m]
-          << ", count = " << std::setw(6) << std::setfill(' ') << node.count[m]
-          << ", value = " << std::fixed << std::setprecision(4) << std::setfill(' ')
-          << (node.count[m] == 0 ? 0.5f : node.value[m] / node.count[m]);
+          << ": prior = " << std::fixed << std::setprecision(4) << std::setfill(' ') << node.prior(i)
+          << ", count = " << std::setw(6) << std::setfill(' ') << node.count(i)
+          << ", value = " << std::fixed << std::setprecision(4) << std::setfill(' ') << node.value(i);
       }
     }
     LOG(debug_log) << "    <est. score>: " << std::fixed << std::setprecision(4) << std::setfill(' ')
                    << node.prior_score;
 
-    // Since pass is always a valid move, sum should always be positive.
+    // Since the root is always searched, sum should always be positive.
     ASSERT(sum > 0);
     float r = dist(engine) * sum;
-    for (size_t m = 0; m < TotalMoves; ++m) {
-      if (node.prior[m] < 0.0f) continue;
-      r -= p[m];
+    for (unsigned i = 0; i < node.size(); ++i) {
+      r -= p[i];
       if (r < 0.0f) {
-        go_engine::Move move(color, m);
+        Move move(color, node.move(i));
         LOG(debug_log) << "(MCTS)==> play: " << move.DebugString() << "\n";
         return move;
       }
@@ -142,131 +701,672 @@ public:
     return {color};
   }
 
-  void play(go_engine::Move move) {
+  void play(Move move) {
+    stop_pondering();
+    book_count.reset();
     ASSERT(board.is_valid(move)) << board.DebugString();
-    ASSERT(id < states.size()) << id << " >= " << states.size();
     board.play(move);
+    ++generation;
     history.push_back(move);
 
-    if (board.finished()) {
-      id = static_cast<size_t>(-1);
-    } else {
-      size_t m = move.id();
-      ASSERT(m < go_engine::TotalMoves) << move.DebugString();
-      auto& node = states[id];
-      if (node.child[m] == Unexplored) {
-        node.child[m] = states.size();
-        init_node(board);
+    size_t next = NoRoot;
+    if (!board.finished() && id != NoRoot) {
+      ASSERT(id < states.size()) << id << " >= " << states.size();
+      const Node& node = states[id];
+      const unsigned i = node.find(move.id());
+      // With transpositions, the node may be created from another move order in which this move is
+      // forbidden by superko, and then it has no edge for the move.
+      ASSERT(i < node.size() || transpositions) << move.DebugString();
+      if (i < node.expanded()) {
+        ASSERT(node.edge(i).child != Pending);
+        if (node.edge(i).child != Unexplored) {
+          next = node.edge(i).child;
+        }
       }
-      id = node.child[m];
     }
+    id = next;
+    // Nothing outside the subtree of the new root can be reached any more.
+    compact();
+    if (ponder_budget.simulations > 0 && !board.finished() && board.get_next_player() != color) {
+      ponder();
+    }
+  }
+
+  bool finished() const {
+    return board.finished();
   }
 
   float score() const {
     return color == go_engine::BLACK ? board.score() : -board.score();
   }
-  bool is_valid(go_engine::Move move) const {
+  bool is_valid(Move move) const {
     return board.is_valid(move);
   }
+
+  // Number of moves played since the beginning of the game.
+  size_t move_count() const {
+    return history.size();
+  }
+
+  // Number of nodes currently held by the tree.
+  size_t node_count() const {
+    return states.size();
+  }
+
+  // Number of times a new state is found to be a transposition of an existing node.
+  size_t transposition_count() const {
+    return transposition_hits.load(std::memory_order_relaxed);
+  }
+
+  // Call f(board, count) for the current game state and the states under it in the tree, up to
+  // depth moves deeper, where count is the search count of all moves (indexed by move id).  States
+  // searched less than min_count times, and those under them, are skipped.
+  template<typename F>
+  void for_each_state(unsigned depth, unsigned min_count, F&& f) {
+    stop_pondering();
+    if (id == NoRoot) return;
+    BoardInfo b(board);
+    visit_states(id, b, depth, min_count, f);
+  }
+
+  // Write the game state and the tree under it to filename in the format of tree_io.  The file is
+  // written under a temporary name and renamed once complete.  Return false on failure.
+  bool save(const std::string& filename) {
+    stop_pondering();
+    tree_io::FileHeader header{};
+    memcpy(header.magic, tree_io::Magic, sizeof(header.magic));
+    header.version = tree_io::Version;
+    header.board_size = N;
+    header.komi = board.get_komi();
+    header.history_length = history.size();
+    std::vector<uint16_t> moves(history.size() + (4 - history.size() % 4) % 4, 0);
+    for (size_t i = 0; i < history.size(); ++i) {
+      moves[i] = history[i].id();
+    }
+
+    // Nodes in BFS order from the root, as in compact().
+    std::vector<unsigned> order;
+    std::vector<unsigned> new_id;
+    if (id != NoRoot) {
+      order.push_back(id);
+      new_id.assign(states.size(), Unexplored);
+      new_id[id] = 0;
+    }
+    std::vector<tree_io::NodeRecord> records;
+    for (size_t k = 0; k < order.size(); ++k) {
+      const Node& node = states[order[k]];
+      tree_io::NodeRecord r{};
+      r.edge_begin = header.edge_count;
+      r.stats_begin = header.stats_count;
+      r.total_count = node.total_count;
+      r.prior_score = node.prior_score;
+      r.size = node.size();
+      r.expanded = node.expanded();
+      records.push_back(r);
+      header.edge_count += 2 * node.size();
+      header.stats_count += node.expanded();
+      for (unsigned i = 0; i < node.expanded(); ++i) {
+        const unsigned child = node.edge(i).child;
+        ASSERT(child != Pending);
+        if (child != Unexplored && new_id[child] == Unexplored) {
+          new_id[child] = order.size();
+          order.push_back(child);
+        }
+      }
+    }
+    header.node_count = order.size();
+
+    const std::string tmp_filename = filename + ".tmp";
+    std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)moves.data(), moves.size() * sizeof(uint16_t));
+    out.write((const char*)records.data(), records.size() * sizeof(tree_io::NodeRecord));
+    for (unsigned n : order) {
+      out.write((const char*)states[n].packed_edges(), 2 * states[n].size() * sizeof(uint16_t));
+    }
+    const uint16_t padding = 0;
+    out.write((const char*)&padding, header.edge_count % 2 * sizeof(uint16_t));
+    std::vector<EdgeStats> edges;
+    for (unsigned n : order) {
+      const Node& node = states[n];
+      edges.clear();
+      for (unsigned i = 0; i < node.expanded(); ++i) {
+        edges.push_back(node.edge(i));
+        if (edges.back().child != Unexplored) {
+          edges.back().child = new_id[edges.back().child];
+        }
+      }
+      out.write((const char*)edges.data(), edges.size() * sizeof(EdgeStats));
+    }
+    out.close();
+    if (out.fail() || std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+      std::remove(tmp_filename.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // Replace the game state and the tree by those saved in filename.  The file is mapped privately,
+  // and edges and search statistics of its nodes are used in place, so further searches don't
+  // change the file.  The board is rebuilt by replaying the moves played.  Nodes loaded are not
+  // found as transpositions.  Return false, with the tree reset, if filename can't be read or is
+  // not a snapshot of this board size and komi.
+  bool load(const std::string& filename) {
+    reset();
+    auto file = std::make_unique<tree_io::MappedFile>(filename);
+    if (!restore(*file)) {
+      reset();
+      return false;
+    }
+    snapshot = std::move(file);
+    return true;
+  }
+
+  // Start a simulation from the current game state.  If a new state is reached, the simulation is
+  // suspended and NeedEval is returned, the caller must then evaluate sim.board and resume the
+  // simulation with finish_simulation().
+  //
+  // This allows the caller to keep many simulations (of the same or different trees) in flight and
+  // evaluate all of them as a batch.  Not thread safe with respect to other calls of this function
+  // (unlike searches in gen_play()).
+  SimulationState start_simulation(Simulation& sim) {
+    CHECK(!board.finished()) << board.DebugString();
+    return descend(sim, false);
+  }
+
+  void finish_simulation(Simulation& sim, const std::array<float, TotalMoves>& prior, float value) {
+    expand(sim, prior, value, dir);
+  }
 private:
-  // Perform a full Monte Carlo tree search from state id.  Return value is the score of this move
-  // (winning probability of the current player).
-  float search_from(size_t root, bool debug_log) {
-    go_engine::BoardInfo local_board(board);
-    std::function<float(size_t)> search_recursively =
-      [this, &search_recursively, &local_board, debug_log](size_t root) -> float {
-      ASSERT(root < states.size());
-      auto& node = states[root];
+  // Moves are sampled with probabilities proportional to count^inverse_temperature().
+  float inverse_temperature() const {
+    return history.size() < N ? 1.0f : 5.0f;
+  }
+
+  // Pick a move of the current game state from the book counts, as select_move() does from search
+  // counts.  Moves invalid here (a hash collision, or superko) are ignored.
+  std::optional<Move> book_move(bool debug_log) {
+    std::array<unsigned, TotalMoves> count;
+    if (!book->lookup(board, count)) return std::nullopt;
+    std::array<float, TotalMoves> p;
+    float sum = 0.0f;
+    for (unsigned m = 0; m < TotalMoves; ++m) {
+      if (count[m] > 0 && !board.is_valid(Move(color, m))) count[m] = 0;
+      p[m] = std::pow(count[m], inverse_temperature());
+      sum += p[m];
+    }
+    if (sum <= 0.0f) return std::nullopt;
+    book_count = count;
+    float r = dist(engine) * sum;
+    for (unsigned m = 0; m < TotalMoves; ++m) {
+      r -= p[m];
+      if (r < 0.0f && count[m] > 0) {
+        Move move(color, m);
+        LOG(debug_log) << board.DebugString() << "\n(BOOK)==> play: " << move.DebugString() << "\n";
+        return move;
+      }
+    }
+    // Rounding, take the last move with a count.
+    for (unsigned m = TotalMoves; m-- > 0;) {
+      if (count[m] > 0) return Move(color, m);
+    }
+    return std::nullopt;
+  }
+
+  template<typename F>
+  void visit_states(size_t n, BoardInfo& b, unsigned depth, unsigned min_count, F& f) {
+    const Node& node = states[n];
+    const go_engine::Color c = b.get_next_player();
+    std::array<unsigned, TotalMoves> count{};
+    unsigned total = 0;
+    for (unsigned i = 0; i < node.expanded(); ++i) {
+      // With transpositions, edges may be forbidden by superko on this path.
+      if (!b.is_valid(Move(c, node.move(i)))) continue;
+      count[node.move(i)] = node.count(i);
+      total += node.count(i);
+    }
+    if (total == 0 || total < min_count) return;
+    f((const BoardInfo&)b, (const std::array<unsigned, TotalMoves>&)count);
+    if (depth == 0) return;
+    for (unsigned i = 0; i < node.expanded(); ++i) {
+      const unsigned child = node.edge(i).child;
+      if (child == Unexplored || count[node.move(i)] == 0) continue;
+      b.play(Move(c, node.move(i)));
+      if (!b.finished()) {
+        visit_states(child, b, depth - 1, min_count, f);
+      }
+      b.undo();
+    }
+  }
+
+  // Replay the moves and reference the nodes of a snapshot mapped in file, after checking all of
+  // its indices.
+  bool restore(const tree_io::MappedFile& file) {
+    if (file.size < sizeof(tree_io::FileHeader)) return false;
+    const auto* header = (const tree_io::FileHeader*)file.base;
+    if (memcmp(header->magic, tree_io::Magic, sizeof(header->magic)) != 0 || header->version != tree_io::Version ||
+        header->board_size != N || header->komi != board.get_komi()) {
+      return false;
+    }
+    // Counts are bounded first, so that offsets don't overflow.
+    const uint64_t body = file.size - sizeof(tree_io::FileHeader);
+    if (header->history_length > body / sizeof(uint16_t) || header->node_count > body / sizeof(tree_io::NodeRecord) ||
+        header->edge_count > body / sizeof(uint16_t) || header->stats_count > body / sizeof(EdgeStats) ||
+        header->node_count >= Pending) {
+      return false;
+    }
+    const uint64_t nodes_offset =
+      sizeof(tree_io::FileHeader) + ((uint64_t)header->history_length + 3) / 4 * 4 * sizeof(uint16_t);
+    const uint64_t edges_offset = nodes_offset + header->node_count * sizeof(tree_io::NodeRecord);
+    const uint64_t stats_offset = edges_offset + (header->edge_count + header->edge_count % 2) * sizeof(uint16_t);
+    if (stats_offset + header->stats_count * sizeof(EdgeStats) != file.size) return false;
+
+    const auto* moves = (const uint16_t*)(header + 1);
+    for (size_t i = 0; i < header->history_length; ++i) {
+      if (board.finished() || moves[i] >= TotalMoves) return false;
+      const Move move(board.get_next_player(), moves[i]);
+      if (!board.is_valid(move)) return false;
+      board.play(move);
+      history.push_back(move);
+    }
+    ++generation;
+    if (header->node_count == 0) return true;
+    if (board.finished()) return false;
+
+    const auto* records = (const tree_io::NodeRecord*)(file.base + nodes_offset);
+    const auto* edges = (const uint16_t*)(file.base + edges_offset);
+    auto* stats = (EdgeStats*)(file.base + stats_offset);
+    // Number of edges leading to each node, to check below that the nodes form a DAG.
+    std::vector<unsigned> parents(header->node_count, 0);
+    for (size_t n = 0; n < header->node_count; ++n) {
+      const tree_io::NodeRecord& r = records[n];
+      if (r.size == 0 || r.size > TotalMoves || r.expanded > r.size || r.edge_begin > header->edge_count ||
+          2 * r.size > header->edge_count - r.edge_begin || r.stats_begin > header->stats_count ||
+          r.expanded > header->stats_count - r.stats_begin) {
+        return false;
+      }
+      for (unsigned i = 0; i < r.size; ++i) {
+        if (edges[r.edge_begin + i] >= TotalMoves) return false;
+      }
+      for (unsigned i = 0; i < r.expanded; ++i) {
+        const unsigned child = stats[r.stats_begin + i].child;
+        if (child == Unexplored) continue;
+        if (child >= header->node_count) return false;
+        ++parents[child];
+      }
+      states.push_back(Node(edges + r.edge_begin, r.size, stats + r.stats_begin, r.expanded, r.total_count,
+                            r.prior_score));
+    }
+
+    // Moves are only checked by descend() with transpositions, otherwise those of the root must be
+    // legal on the restored board.  Those of descendants are not checked.
+    if (!transpositions) {
+      const auto legal = board.legal_moves();
+      for (unsigned i = 0; i < states[0].size(); ++i) {
+        if (!legal[states[0].move(i)]) return false;
+      }
+    }
+    if (parents[0] != 0) return false;
+    // Nodes are removed in topological order from the root.  Saved trees only have nodes reachable
+    // from the root, so any node left is corrupted: unreachable, or on a cycle descend() would never
+    // leave.
+    std::vector<unsigned> ready = {0};
+    size_t removed = 0;
+    while (!ready.empty()) {
+      const Node& node = states[ready.back()];
+      ready.pop_back();
+      ++removed;
+      for (unsigned i = 0; i < node.expanded(); ++i) {
+        const unsigned child = node.edge(i).child;
+        if (child != Unexplored && --parents[child] == 0) ready.push_back(child);
+      }
+    }
+    if (removed != header->node_count) return false;
+    id = 0;
+    return true;
+  }
+
+  // With transpositions, a node may be reached from a path other than the one it's created from,
+  // and some of its moves may be forbidden by superko on the current path.
+  bool is_valid_edge(const Node& node, unsigned i) const {
+    return !transpositions || board.is_valid(Move(board.get_next_player(), node.move(i)));
+  }
+
+  // Keep only the nodes reachable from the current root (which becomes node 0), renumber child
+  // indices and release memory held by all other nodes.  Search statistics of the kept nodes are
+  // kept.
+  //
+  // Nodes are stored in BFS order afterwards, which also improves locality of the following
+  // searches.
+  void compact() {
+    if (id == NoRoot) {
+      states.clear();
+      if (transpositions) transpositions->clear();
+      return;
+    }
+    ASSERT(id < states.size()) << id << " >= " << states.size();
+    if (id == 0 && states.size() == 1) return;
+
+    // order[k] is the old index of the k-th live node, new_id is the reverse mapping.  Nodes may
+    // have multiple parents with transpositions.
+    std::vector<unsigned> order{static_cast<unsigned>(id)};
+    std::vector<unsigned> new_id(states.size(), Unexplored);
+    new_id[id] = 0;
+    for (size_t k = 0; k < order.size(); ++k) {
+      Node& node = states[order[k]];
+      for (unsigned i = 0; i < node.expanded(); ++i) {
+        EdgeStats& edge = node.edge(i);
+        ASSERT(edge.child != Pending);
+        if (edge.child != Unexplored) {
+          if (new_id[edge.child] == Unexplored) {
+            new_id[edge.child] = order.size();
+            order.push_back(edge.child);
+          }
+          edge.child = new_id[edge.child];
+        }
+      }
+    }
+    if (transpositions) transpositions->renumber(new_id);
+    NodePool live;
+    for (unsigned old_id : order) {
+      live.push_back(std::move(states[old_id]));
+    }
+    states.swap(live);
+    id = 0;
+  }
+
+  // Whether the most searched move of the current game state stays so after remaining more
+  // simulations, whatever their results.
+  bool search_decided(size_t remaining) {
+    if (id == NoRoot) return false;
+    const Node& node = states[id];
+    unsigned first = 0, second = 0;
+    std::lock_guard<SpinLock> lock(node_lock(id));
+    for (unsigned i = 0; i < node.expanded(); ++i) {
+      if (!is_valid_edge(node, i)) continue;
+      const unsigned count = node.count(i);
+      if (count > first) {
+        second = first;
+        first = count;
+      } else if (count > second) {
+        second = count;
+      }
+    }
+    return first - second > remaining;
+  }
+
+  // Search the current game state within search_budget using search_threads threads, or until
+  // cancel (if not null) is set.
+  SearchStats run_search(const SearchBudget& search_budget, const std::atomic<bool>* cancel) {
+    const Clock::time_point start = Clock::now();
+    if (id == NoRoot) {
+      // Create the root before other threads can reach it.
+      Simulation sim;
+      CHECK(descend(sim, false) == SimulationState::NeedEval);
+      evaluate_and_expand(sim, dir);
+    }
+    std::atomic<long> remaining(std::min<size_t>(search_budget.simulations, std::numeric_limits<long>::max()));
+    std::atomic<size_t> completed(0);
+    std::atomic<bool> stopped(false);
+    SearchStop stop = SearchStop::Simulations;
+    auto worker = [&]() {
+      DirichletDist<TotalMoves> noise(1.03f);
+      Simulation sim;
+      while (!stopped.load(std::memory_order_relaxed) && remaining.fetch_sub(1, std::memory_order_relaxed) > 0) {
+        switch (descend(sim, false)) {
+        case SimulationState::Done:
+          completed.fetch_add(1, std::memory_order_relaxed);
+          break;
+        case SimulationState::NeedEval:
+          evaluate_and_expand(sim, noise);
+          completed.fetch_add(1, std::memory_order_relaxed);
+          break;
+        case SimulationState::Abandoned:
+          // Collided with another thread, try again later.
+          remaining.fetch_add(1, std::memory_order_relaxed);
+          std::this_thread::yield();
+          break;
+        }
+        const auto limit = search_limit(search_budget, completed.load(std::memory_order_relaxed), start,
+                                        search_threads - 1);
+        bool expected = false;
+        if (limit && stopped.compare_exchange_strong(expected, true)) {
+          stop = *limit;
+        } else if (cancel != nullptr && cancel->load(std::memory_order_relaxed) &&
+                   stopped.compare_exchange_strong(expected, true)) {
+          stop = SearchStop::Stopped;
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < search_threads; ++i) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : threads) {
+      t.join();
+    }
+    SearchStats result;
+    result.simulations = completed.load();
+    result.time = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+    result.nodes = states.size();
+    result.stop = stop;
+    return result;
+  }
+
+  void evaluate_and_expand(Simulation& sim, DirichletDist<TotalMoves>& noise) {
+    std::array<float, TotalMoves> prior;
+    const float value = eval(*sim.board, prior);
+    expand(sim, prior, value, noise);
+  }
+
+  // Descend from the current game state until a terminal state or a new state is reached.
+  //
+  // Multiple threads may search the same tree concurrently: edges selected by a simulation get a
+  // virtual loss until it's backed up, so that other simulations are steered to different paths.
+  // Selection, expansion of edge stats and backup of each node are protected by a lock of the node.
+  // An edge leading to a new state is marked Pending until the state is evaluated, other
+  // simulations reaching it are abandoned.
+  SimulationState descend(Simulation& sim, bool debug_log) {
+    if (sim.board && sim.generation == generation) {
+      // Each edge on the path is a move played on sim.board.
+      for (size_t i = 0; i < sim.path.size(); ++i) {
+        sim.board->undo();
+      }
+    } else {
+      sim.board.emplace(board);
+      sim.generation = generation;
+    }
+    sim.path.clear();
+    BoardInfo& local_board = *sim.board;
+    if (id == NoRoot) {
+      if (root_pending) return SimulationState::Abandoned;
+      root_pending = true;
+      return SimulationState::NeedEval;
+    }
+
+    size_t current = id;
+    while (true) {
+      ASSERT(current < states.size());
+      Node& node = states[current];
       LOG(debug_log) << "\n" << local_board.DebugString();
 
       go_engine::Color c = local_board.get_next_player();
-      float ucb1_max = -std::numeric_limits<float>::infinity();
-      unsigned m_max = TotalMoves;
-      const float nsq = sqrt((float)node.total_count);
-      for (unsigned m = 0; m < TotalMoves; ++m) {
-        go_engine::Move move(c, m);
-        if (node.prior[m] < 0.0f) {
-          continue;
+      unsigned i_max = node.size();
+      unsigned child = Unexplored;
+      {
+        std::lock_guard<SpinLock> lock(node_lock(current));
+        // Edges excluded because they are forbidden by superko on this path, see is_valid_edge().
+        std::bitset<TotalMoves> excluded;
+        while (true) {
+          float ucb1_max = -std::numeric_limits<float>::infinity();
+          const float nsq = sqrt((float)node.total_count);
+          for (unsigned i = 0; i < node.size(); ++i) {
+            if (excluded[i]) continue;
+            const unsigned count = node.count(i);
+            float u = node.value(i) + node.prior(i) * nsq / (1 + count);
+            LOG(debug_log) << "    " << Move(c, node.move(i)).DebugString() << " ==> prior = "
+                           << std::setfill('0') << std::fixed << node.prior(i)
+                           << ", visit = " << std::setw(10) << std::setfill(' ') << count
+                           << ", value = " << std::setprecision(3) << std::setfill(' ') << std::scientific
+                           << node.value(i)
+                           << ", ucb = " << std::setw(14) << std::setfill(' ') << std::scientific << u;
+            if (u > ucb1_max) {
+              ucb1_max = u;
+              i_max = i;
+            }
+            // Edges are only legal moves, and those beyond expanded() are unvisited and sorted by
+            // prior, so only the first of them can be picked.
+            if (i >= node.expanded()) break;
+          }
+          // Note that pass is always a valid move.
+          ASSERT(i_max < node.size()) << "\n" << local_board.DebugString();
+          if (!transpositions || local_board.is_valid(Move(c, node.move(i_max)))) break;
+          excluded.set(i_max);
         }
-        if (local_board.is_valid(move)) {
-          float u = node.count[m] == 0 ? 0.5f : node.value[m] / static_cast<float>(node.count[m]);
-          u += node.prior[m] * nsq / (1 + node.count[m]);
-          LOG(debug_log) << "    " << move.DebugString() << " ==> prior = " << std::setfill('0') << std::fixed << node.prior[m]
-                         << ", visit = " << std::setw(10) << std::setfill(' ') << node.count[m]
-                         << ", value = " << std::setprecision(3) << std::setfill(' ') << std::scientific
-                         << (node.count[m] == 0 ? 0.5 : node.value[m] / node.count[m])
-                         << ", ucb = " << std::setw(14) << std::setfill(' ') << std::scientific << u;
-          if (u > ucb1_max) {
-            ucb1_max = u;
-            m_max = m;
+
+        Move move(c, node.move(i_max));
+        LOG(debug_log) << "(MCTS)==> Move: " << move.DebugString();
+
+        EdgeStats& edge = node.expand(i_max);
+        child = edge.child;
+        if (child != Pending) {
+          local_board.play(move);
+          if (child == Unexplored && !local_board.finished()) {
+            if (transpositions) {
+              child = transpositions->find(local_board.get_state_hash());
+            }
+            if (child != Unexplored) {
+              // Continue the descent in the node shared with another move order.
+              edge.child = child;
+              transposition_hits.fetch_add(1, std::memory_order_relaxed);
+            } else {
+              edge.child = Pending;
+            }
           }
-        } else {
-          node.prior[m] = -1.0f;
+          edge.count += VirtualLoss;
+          node.total_count += VirtualLoss;
         }
       }
-      // Note that pass is always a valid move.
-      ASSERT(m_max < TotalMoves) << "\n" << local_board.DebugString();
-
-      go_engine::Move move(c, m_max);
-      LOG(debug_log) << "(MCTS)==> Move: " << move.DebugString();
-      local_board.play(move);
+      if (child == Pending) {
+        // The child is being evaluated for another simulation.  Reverted without holding the lock
+        // of this node, since backup() takes the (striped, non-recursive) locks of the path.
+        backup(sim, -1.0f);
+        return SimulationState::Abandoned;
+      }
+      sim.path.emplace_back(current, i_max);
 
-      float score = 0.0f;
       if (local_board.finished()) {
-        score = c == go_engine::BLACK ? local_board.score() >= 0 : local_board.score() < 0;
+        float score = c == go_engine::BLACK ? local_board.score() >= 0 : local_board.score() < 0;
         LOG(debug_log) << "(MCTS)==> " << go_engine::to_string(c) << ": score (Count) = " << score;
-      } else if (node.child[m_max] == Unexplored) {
-        node.child[m_max] = states.size();
-        score = 1.0f - init_node(local_board);
-        LOG(debug_log) << "(MCTS)==> " << go_engine::to_string(c) << ": score (NN) = " << score;
-      } else {
-        ASSERT(node.child[m_max] < states.size());
-        // Continue by recursive play.
-        score = 1.0f - search_recursively(node.child[m_max]);
+        backup(sim, score);
+        return SimulationState::Done;
+      } else if (child == Unexplored) {
+        return SimulationState::NeedEval;
       }
-      // Update.
-      ++states[root].count[m_max];
-      states[root].value[m_max] += score;
-      ++states[root].total_count;
-      return score;
-    };
-    return search_recursively(root);
+      current = child;
+    }
   }
 
-  // The new node is always appended to the end of the vector of nodes, which means its id (pointer)
-  // is implicitly defined.
-  float init_node(const go_engine::BoardInfo& b) {
-    states.emplace_back();
-    auto& node = states.back();
-    for (size_t m = 0; m < TotalMoves; ++m) {
-      node.count[m] = 0;
-      node.value[m] = 0.0f;
-      node.child[m] = Unexplored;
+  // Resume a simulation suspended at a new state, value is the eval result of the new state.
+  void expand(Simulation& sim, const std::array<float, TotalMoves>& prior, float value,
+              DirichletDist<TotalMoves>& noise) {
+    size_t child = init_node(*sim.board, prior, value, noise);
+    if (transpositions) {
+      // Another simulation may have created a node for the same state from another move order, in
+      // which case the new node is never referenced and dropped by the next compaction.
+      child = transpositions->insert(sim.board->get_state_hash(), child);
+    }
+    if (sim.path.empty()) {
+      ASSERT(root_pending && id == NoRoot);
+      id = child;
+      root_pending = false;
+      return;
     }
-    node.total_count = 0;
-    node.prior_score = eval(b, node.prior);
+    const auto [parent, i] = sim.path.back();
+    {
+      std::lock_guard<SpinLock> lock(node_lock(parent));
+      EdgeStats& edge = states[parent].edge(i);
+      ASSERT(edge.child == Pending) << edge.child;
+      edge.child = child;
+    }
+    backup(sim, 1.0f - value);
+  }
+
+  // Revert virtual losses along the path of a simulation, and add score (winning probability of the
+  // player making the last move of the path) unless it's negative (abandoned simulation).
+  void backup(const Simulation& sim, float score) {
+    for (auto it = sim.path.rbegin(); it != sim.path.rend(); ++it) {
+      Node& node = states[it->first];
+      // Edge stats may have been moved by other threads since selection.
+      std::lock_guard<SpinLock> lock(node_lock(it->first));
+      EdgeStats& edge = node.edge(it->second);
+      if (score < 0.0f) {
+        edge.count -= VirtualLoss;
+        node.total_count -= VirtualLoss;
+      } else {
+        edge.count -= VirtualLoss - 1;
+        edge.value += score;
+        node.total_count -= VirtualLoss - 1;
+        score = 1.0f - score;
+      }
+    }
+  }
+
+  // Create a new node for state b and return its id.  Thread safe.
+  size_t init_node(const BoardInfo& b, std::array<float, TotalMoves> prior, float prior_score,
+                   DirichletDist<TotalMoves>& noise_gen) {
     // Add Dirichlet noise to encourage exploration.
-    const std::array<float, TotalMoves>& noise = dir.gen();
+    const std::array<float, TotalMoves>& noise = noise_gen.gen();
     for (size_t m = 0; m < TotalMoves; ++m) {
-      node.prior[m] = node.prior[m] * 0.75f + noise[m] * 0.25f;
+      prior[m] = prior[m] * 0.75f + noise[m] * 0.25f;
     }
-    return node.prior_score;
+    return states.push_back(Node(b, prior, prior_score));
+  }
+
+  SpinLock& node_lock(size_t i) {
+    return locks[i % locks.size()];
   }
 
   // Control parameters.
-  static constexpr size_t SearchCount = 1000;
+  // Number of visits (with a score of 0) temporarily added to an edge while it's being searched.
+  static constexpr unsigned VirtualLoss = 3;
 
-  go_engine::BoardInfo board;
+  BoardInfo board;
+  // Changed whenever board is changed, see Simulation::generation.
+  size_t generation = 0;
   const go_engine::Color color;
   size_t id; // Current Node in states corresponding to the board.
+  bool root_pending = false;
   EvalEngine eval;
+  const unsigned search_threads;
+  const SearchBudget budget;
+  SearchStats stats;
+  const std::shared_ptr<const OpeningBook> book;
+  // Book counts of the current game state, if gen_play() took its move from the book.
+  std::optional<std::array<unsigned, TotalMoves>> book_count;
+  SearchBudget ponder_budget;
+  std::thread ponder_thread;
+  std::atomic<bool> ponder_cancel{false};
+  std::atomic<bool> ponder_running{false};
+  SearchStats ponder_result;
+  // nullptr unless SearchOptions::transpositions is set.
+  const std::unique_ptr<TranspositionTable> transpositions;
+  std::atomic<size_t> transposition_hits{0};
 
-  std::vector<Node> states;
-  std::vector<go_engine::Move> history;
+  NodePool states;
+  // Snapshot loaded by load(), whose memory is used by nodes.
+  std::unique_ptr<tree_io::MappedFile> snapshot;
+  std::array<SpinLock, 256> locks;
+  std::vector<Move> history;
   std::default_random_engine engine;
   std::uniform_real_distribution<float> dist;
   DirichletDist<TotalMoves> dir;
 };
+
+// Search tree of the default board size.
+template<typename EvalEngine>
+using Tree = BasicTree<go_engine::N, EvalEngine>;
 }  // mcts
 
 #endif  // #ifndef INCLUDE_GUARD_MCTS_H__
@@ -0,0 +1,253 @@
+// -*- mode:c++; c-basic-offset:2; coding:utf-8-unix -*-
+// ==================================================================================================
+#ifndef INCLUDE_GUARD_OPENING_BOOK_H__
+#define INCLUDE_GUARD_OPENING_BOOK_H__
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "debug_msg.h"
+
+namespace mcts {
+
+// Binary format of opening books, all integers are little endian.
+//
+// File:
+//   FileHeader
+//   Entry entries[entry_count]: positions sorted by key, which is BoardInfo::get_state_hash() (so
+//     it includes the player to move).
+//   CountEntry counts[count_total]: non-zero search counts of each position, sorted by move.
+namespace book_io {
+constexpr char Magic[8] = {'M', 'C', 'T', 'S', 'B', 'O', 'O', 'K'};
+constexpr uint32_t Version = 1;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t board_size;
+  float komi;
+  uint32_t reserved;
+  uint64_t entry_count;
+  uint64_t count_total;
+};
+static_assert(sizeof(FileHeader) == 40);
+
+struct Entry {
+  uint64_t key;
+  // counts[count_begin, count_begin + count_size) are those of this position.
+  uint64_t count_begin;
+  uint32_t count_size;
+  uint32_t reserved;
+};
+static_assert(sizeof(Entry) == 24);
+
+struct CountEntry {
+  uint32_t move;
+  uint32_t count;
+};
+static_assert(sizeof(CountEntry) == 8);
+}  // namespace book_io
+
+// Accumulates search counts of positions, from self-play games or searched trees, and writes them
+// as an opening book.  Counts of the same position from different sources are added up.
+//
+// Not thread safe.
+template<unsigned N>
+class BasicOpeningBookBuilder {
+  using BoardInfo = go_engine::BasicBoardInfo<N>;
+  using Move = go_engine::BasicMove<N>;
+  static constexpr size_t TotalMoves = N * N + 1;
+public:
+  // Only the first max_moves positions of games are added.
+  BasicOpeningBookBuilder(float _komi, unsigned _max_moves)
+    : komi(_komi)
+    , max_moves(_max_moves)
+  {}
+
+  float get_komi() const {
+    return komi;
+  }
+
+  // Number of positions added so far.
+  size_t size() const {
+    return positions.size();
+  }
+
+  // Add search counts (indexed by move id) of position b.
+  void add(const BoardInfo& b, const std::array<unsigned, TotalMoves>& count) {
+    auto& total = positions.try_emplace(b.get_state_hash()).first->second;
+    for (size_t m = 0; m < TotalMoves; ++m) {
+      total[m] += count[m];
+    }
+  }
+
+  // Add a game from its moves and the search counts of each move, see GameRecord.  Return false if
+  // a move is invalid, in which case positions before it are still added.
+  template<typename Moves, typename Counts>
+  bool add_game(const Moves& moves, const Counts& search_count) {
+    BoardInfo b(komi);
+    for (size_t i = 0; i < moves.size() && i < max_moves; ++i) {
+      const Move move(moves[i]);
+      if (!b.is_valid(move)) return false;
+      add(b, search_count[i]);
+      b.play(move);
+    }
+    return true;
+  }
+
+  // Write positions searched at least min_count times in total to filename.  The file is written
+  // under a temporary name and renamed once complete.  Return false on failure.
+  bool write(const std::string& filename, unsigned min_count = 1) const {
+    std::vector<const std::pair<const uint64_t, std::array<unsigned, TotalMoves>>*> kept;
+    for (const auto& p : positions) {
+      unsigned long long total = 0;
+      for (unsigned c : p.second) total += c;
+      if (total > 0 && total >= min_count) kept.push_back(&p);
+    }
+    std::sort(kept.begin(), kept.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+
+    std::vector<book_io::Entry> entries;
+    std::vector<book_io::CountEntry> counts;
+    for (const auto* p : kept) {
+      book_io::Entry e{};
+      e.key = p->first;
+      e.count_begin = counts.size();
+      for (size_t m = 0; m < TotalMoves; ++m) {
+        if (p->second[m] > 0) {
+          counts.push_back({(uint32_t)m, p->second[m]});
+        }
+      }
+      e.count_size = counts.size() - e.count_begin;
+      entries.push_back(e);
+    }
+    book_io::FileHeader header{};
+    memcpy(header.magic, book_io::Magic, sizeof(header.magic));
+    header.version = book_io::Version;
+    header.board_size = N;
+    header.komi = komi;
+    header.entry_count = entries.size();
+    header.count_total = counts.size();
+
+    const std::string tmp_filename = filename + ".tmp";
+    std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)entries.data(), entries.size() * sizeof(book_io::Entry));
+    out.write((const char*)counts.data(), counts.size() * sizeof(book_io::CountEntry));
+    out.close();
+    if (out.fail() || std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+      std::remove(tmp_filename.c_str());
+      return false;
+    }
+    return true;
+  }
+private:
+  const float komi;
+  const unsigned max_moves;
+  std::unordered_map<uint64_t, std::array<unsigned, TotalMoves>> positions;
+};
+
+using OpeningBookBuilder = BasicOpeningBookBuilder<go_engine::N>;
+
+// Read-only view of a file written by OpeningBookBuilder.  The file is mapped into memory, so its
+// pages are shared by all processes using it, and positions are found by binary search.
+//
+// The board size is read from the file, so this is not a template.  Thread safe.
+class OpeningBook {
+public:
+  explicit OpeningBook(const std::string& filename) {
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(book_io::FileHeader)) {
+      size = st.st_size;
+      void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED) {
+        data = (const char*)p;
+      }
+    }
+    ::close(fd);
+    if (data == nullptr) return;
+    const auto* header = file_header();
+    // Counts are bounded first, so that the total size doesn't overflow.
+    const size_t body = size - sizeof(book_io::FileHeader);
+    valid = memcmp(header->magic, book_io::Magic, sizeof(header->magic)) == 0 &&
+      header->version == book_io::Version && header->entry_count <= body / sizeof(book_io::Entry) &&
+      header->count_total <= body / sizeof(book_io::CountEntry) &&
+      header->entry_count * sizeof(book_io::Entry) + header->count_total * sizeof(book_io::CountEntry) == body;
+    if (valid) {
+      entries = (const book_io::Entry*)(header + 1);
+      counts = (const book_io::CountEntry*)(entries + header->entry_count);
+    }
+  }
+
+  ~OpeningBook() {
+    if (data != nullptr) {
+      munmap((void*)data, size);
+    }
+  }
+  OpeningBook(const OpeningBook&) = delete;
+  OpeningBook& operator=(const OpeningBook&) = delete;
+
+  // False if the file can't be read or is not a valid opening book.
+  bool ok() const {
+    return valid;
+  }
+
+  unsigned board_size() const {
+    return file_header()->board_size;
+  }
+  float komi() const {
+    return file_header()->komi;
+  }
+  // Number of positions.
+  size_t position_count() const {
+    return file_header()->entry_count;
+  }
+
+  // Fill count (indexed by move id) with the search counts of position b and return true, or return
+  // false if b is not in the book.  b must be of board_size().
+  template<unsigned N>
+  bool lookup(const go_engine::BasicBoardInfo<N>& b, std::array<unsigned, N * N + 1>& count) const {
+    ASSERT(board_size() == N) << board_size() << " != " << N;
+    const uint64_t key = b.get_state_hash();
+    const book_io::Entry* end = entries + position_count();
+    const book_io::Entry* it = std::lower_bound(entries, end, key,
+                                                [](const book_io::Entry& e, uint64_t k) { return e.key < k; });
+    if (it == end || it->key != key) return false;
+    // A corrupted entry is treated as missing.
+    const uint64_t total = file_header()->count_total;
+    if (it->count_begin > total || it->count_size > total - it->count_begin) return false;
+    count.fill(0);
+    for (uint64_t j = it->count_begin; j < it->count_begin + it->count_size; ++j) {
+      if (counts[j].move > N * N) return false;
+      count[counts[j].move] = counts[j].count;
+    }
+    return true;
+  }
+private:
+  const book_io::FileHeader* file_header() const {
+    return (const book_io::FileHeader*)data;
+  }
+
+  const char* data = nullptr;
+  size_t size = 0;
+  bool valid = false;
+  const book_io::Entry* entries = nullptr;
+  const book_io::CountEntry* counts = nullptr;
+};
+}  // namespace mcts
+
+#endif  // #ifndef INCLUDE_GUARD_OPENING_BOOK_H__
@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+# Compare the INT8 CpuNetwork with the float one on positions sampled from game files.
+#
+# Usage: quantization_check.py weights game_file...
+import os, sys, time
+import numpy
+import mcts
+
+CALIBRATION_POSITIONS = 1024
+TEST_POSITIONS = 4096
+BATCH_SIZE = 256
+
+def sample_positions(files, count, size):
+    buffer = mcts.ReplayBuffer(1 << 20, BATCH_SIZE, threads=os.cpu_count(), symmetries=True, size=size)
+    for filename in files:
+        buffer.add_file(filename)
+    batches = []
+    for x, _ in buffer:
+        batches.append(x.copy())
+        if len(batches) * BATCH_SIZE >= count:
+            return numpy.concatenate(batches)[:count]
+
+def timed(network, x):
+    start = time.time()
+    policy, value = network(x)
+    return policy, value, len(x) / (time.time() - start)
+
+def main(weights, files):
+    network = mcts.CpuNetwork(weights, threads=os.cpu_count())
+    size = network.board_size()
+    x = sample_positions(files, CALIBRATION_POSITIONS + TEST_POSITIONS, size)
+    # Positions used for calibration are not tested.
+    quantized = mcts.CpuNetwork(weights, threads=os.cpu_count(), calibration=x[:CALIBRATION_POSITIONS])
+    x = x[CALIBRATION_POSITIONS:]
+
+    policy, value, speed = timed(network, x)
+    qpolicy, qvalue, qspeed = timed(quantized, x)
+    top = numpy.mean(numpy.argmax(policy, axis=1) == numpy.argmax(qpolicy, axis=1))
+    distance = 0.5 * numpy.sum(numpy.abs(policy - qpolicy), axis=1)
+    error = numpy.abs(value - qvalue)
+    print('Positions: {}'.format(len(x)))
+    print('Top move agreement: {:.2%}'.format(top))
+    print('Policy total variation: mean {:.4f}, max {:.4f}'.format(distance.mean(), distance.max()))
+    print('Value absolute error: mean {:.4f}, max {:.4f}'.format(error.mean(), error.max()))
+    print('Positions / s: float {:.0f}, int8 {:.0f} ({:.2f}x)'.format(speed, qspeed, qspeed / speed))
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        sys.exit('Usage: {} weights game_file...'.format(sys.argv[0]))
+    main(sys.argv[1], sys.argv[2:])
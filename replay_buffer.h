@@ -0,0 +1,285 @@
+// -*- mode:c++; c-basic-offset:2; coding:utf-8-unix -*-
+// ==================================================================================================
+#ifndef INCLUDE_GUARD_REPLAY_BUFFER_H__
+#define INCLUDE_GUARD_REPLAY_BUFFER_H__
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "board.h"
+#include "board_features.h"
+#include "debug_msg.h"
+#include "game_io.h"
+
+namespace mcts {
+
+// Training batches sampled from the most recent games, which are read in place from game files
+// (see GameReader), so memory use only depends on the number of games kept, not on the history.
+//
+// Positions are sampled uniformly from all games kept, in a random symmetry if enabled, and
+// encoded as in go_engine::encode_game() by background threads into a fixed set of reusable
+// batches.  Games found to have invalid moves while sampling are dropped.
+template<unsigned N>
+class BasicReplayBuffer {
+  static constexpr size_t InputSize = 3 * N * N;
+  static constexpr size_t TotalMoves = N * N + 1;
+  using Move = go_engine::BasicMove<N>;
+public:
+  struct Batch {
+    // batch_size rows of network input, policy and value.
+    std::vector<float> x;
+    std::vector<float> policy;
+    std::vector<float> value;
+  };
+
+  // Keep the most recent capacity games.  At most batch_count batches exist at a time, threads of
+  // which may be being filled.
+  BasicReplayBuffer(size_t _capacity, size_t _batch_size, unsigned threads, bool _symmetries, uint64_t seed,
+                    size_t batch_count)
+    : capacity(std::max<size_t>(_capacity, 1))
+    , batch_size(std::max<size_t>(_batch_size, 1))
+    , symmetries(_symmetries)
+    , batches(std::max<size_t>(batch_count, std::max(threads, 1U) + 1))
+  {
+    for (size_t i = 0; i < batches.size(); ++i) {
+      batches[i].x.resize(batch_size * InputSize);
+      batches[i].policy.resize(batch_size * TotalMoves);
+      batches[i].value.resize(batch_size);
+      free_batches.push_back(i);
+    }
+    for (unsigned t = 0; t < std::max(threads, 1U); ++t) {
+      workers.emplace_back([this, t, seed]() { work(seed + t); });
+    }
+  }
+
+  ~BasicReplayBuffer() {
+    {
+      std::lock_guard<std::mutex> lock1(window_mutex);
+      std::lock_guard<std::mutex> lock2(batch_mutex);
+      stopped = true;
+    }
+    window_changed.notify_all();
+    batch_freed.notify_all();
+    batch_ready.notify_all();
+    for (auto& w : workers) {
+      w.join();
+    }
+  }
+  BasicReplayBuffer(const BasicReplayBuffer&) = delete;
+  BasicReplayBuffer& operator=(const BasicReplayBuffer&) = delete;
+
+  // Append all games of a file as the most recent ones, dropping the oldest games beyond capacity.
+  // Files are unmapped once none of their games are kept.  Return false if the file can't be read,
+  // is for another board size, or has corrupted games.
+  bool add_file(const std::string& filename) {
+    auto file = std::make_shared<const GameReader>(filename);
+    if (!file->ok() || file->board_size() != N) return false;
+    GameReader::GameView view;
+    for (size_t i = 0; i < file->game_count(); ++i) {
+      if (!file->game(i, &view)) return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(window_mutex);
+      // Games which would be dropped right away are skipped.
+      const size_t skip = file->game_count() > capacity ? file->game_count() - capacity : 0;
+      for (size_t i = skip; i < file->game_count(); ++i) {
+        file->game(i, &view);
+        window.push_back({file, i, end_position});
+        end_position += view.header->move_count;
+      }
+      while (window.size() > capacity) {
+        window.pop_front();
+      }
+      update_positions();
+    }
+    window_changed.notify_all();
+    return true;
+  }
+
+  size_t game_count() const {
+    std::lock_guard<std::mutex> lock(window_mutex);
+    return window.size();
+  }
+
+  // Number of games dropped because of invalid moves.
+  size_t invalid_game_count() const {
+    std::lock_guard<std::mutex> lock(window_mutex);
+    return invalid_games;
+  }
+
+  size_t position_count() const {
+    std::lock_guard<std::mutex> lock(window_mutex);
+    return window.empty() ? 0 : end_position - window.front().first_position;
+  }
+
+  // Block until a batch is filled, and set i to its index.  The batch is not reused until released.
+  // Return false if no batch is ready and no position is kept (all games may have been dropped), or
+  // the buffer is being destroyed.
+  bool acquire(size_t* i) {
+    std::unique_lock<std::mutex> lock(batch_mutex);
+    batch_ready.wait(lock, [this]() { return stopped || !ready_batches.empty() || !has_positions; });
+    if (stopped || ready_batches.empty()) return false;
+    *i = ready_batches.front();
+    ready_batches.pop_front();
+    return true;
+  }
+
+  const Batch& batch(size_t i) const {
+    return batches[i];
+  }
+
+  void release(size_t i) {
+    {
+      std::lock_guard<std::mutex> lock(batch_mutex);
+      free_batches.push_back(i);
+    }
+    batch_freed.notify_one();
+  }
+private:
+  // A game kept in the buffer, positions of all games kept are numbered in order.
+  struct GameRef {
+    std::shared_ptr<const GameReader> file;
+    size_t game;
+    uint64_t first_position;
+  };
+
+  void work(uint64_t seed) {
+    std::mt19937_64 engine(seed);
+    while (true) {
+      size_t i;
+      {
+        std::unique_lock<std::mutex> lock(batch_mutex);
+        batch_freed.wait(lock, [this]() { return stopped || !free_batches.empty(); });
+        if (stopped) return;
+        i = free_batches.back();
+        free_batches.pop_back();
+      }
+      Batch& b = batches[i];
+      for (size_t row = 0; row < batch_size; ++row) {
+        // Each failure drops a game, or means the buffer is stopped.
+        while (!sample(engine, b.x.data() + row * InputSize, b.policy.data() + row * TotalMoves,
+                       b.value.data() + row)) {
+          if (stopped) return;
+        }
+      }
+      {
+        std::lock_guard<std::mutex> lock(batch_mutex);
+        ready_batches.push_back(i);
+      }
+      batch_ready.notify_one();
+    }
+  }
+
+  // Encode a random position, return false if it is from a game with invalid moves, which is dropped,
+  // or the buffer is stopped.
+  bool sample(std::mt19937_64& engine, float* x, float* policy, float* value) {
+    GameRef ref;
+    size_t k;
+    {
+      std::unique_lock<std::mutex> lock(window_mutex);
+      window_changed.wait(lock, [this]() {
+          return stopped || (!window.empty() && end_position > window.front().first_position);
+        });
+      if (stopped) return false;
+      const uint64_t j = std::uniform_int_distribution<uint64_t>(window.front().first_position, end_position - 1)(engine);
+      const auto it = std::upper_bound(window.begin(), window.end(), j, [](uint64_t p, const GameRef& g) {
+          return p < g.first_position;
+        }) - 1;
+      ref = *it;
+      k = j - it->first_position;
+    }
+    // The layout of games is validated when added, their moves only here.
+    GameReader::GameView view;
+    ref.file->game(ref.game, &view);
+
+    go_engine::BasicBoardInfo<N> b(ref.file->komi());
+    for (size_t m = 0; m <= k; ++m) {
+      const unsigned id = game_io::move_id(view.moves[m]);
+      const Move move(game_io::move_color(view.moves[m]), id);
+      if (id >= TotalMoves || !b.is_valid(move)) {
+        drop(ref);
+        return false;
+      }
+      if (m < k) b.play(move);
+    }
+    std::array<float, TotalMoves> count{};
+    for (uint32_t e = view.entry_begin[k]; e < view.entry_begin[k + 1]; ++e) {
+      if (view.entries[e].move >= TotalMoves) {
+        drop(ref);
+        return false;
+      }
+      count[view.entries[e].move] = view.entries[e].count;
+    }
+    const unsigned t = symmetries ? std::uniform_int_distribution<unsigned>(0, go_engine::SymmetryCount - 1)(engine) : 0;
+    go_engine::fill_input_planes(b, x, t);
+    go_engine::fill_targets<N>(count, game_io::move_color(view.moves[k]), view.header->score, policy, value, t);
+    return true;
+  }
+
+  // Remove a game from the window unless it is already gone, and renumber positions of the next ones.
+  void drop(const GameRef& ref) {
+    std::lock_guard<std::mutex> lock(window_mutex);
+    const auto it = std::find_if(window.begin(), window.end(), [&ref](const GameRef& g) {
+        return g.file == ref.file && g.game == ref.game;
+      });
+    if (it == window.end()) return;
+    const uint64_t positions = (it + 1 == window.end() ? end_position : (it + 1)->first_position) - it->first_position;
+    for (auto next = it + 1; next != window.end(); ++next) {
+      next->first_position -= positions;
+    }
+    end_position -= positions;
+    window.erase(it);
+    ++invalid_games;
+    update_positions();
+  }
+
+  // Called with window_mutex held whenever the window changes.
+  void update_positions() {
+    {
+      std::lock_guard<std::mutex> lock(batch_mutex);
+      has_positions = !window.empty() && end_position > window.front().first_position;
+    }
+    batch_ready.notify_all();
+  }
+
+  const size_t capacity;
+  const size_t batch_size;
+  const bool symmetries;
+
+  // Guards window, end_position and invalid_games.
+  mutable std::mutex window_mutex;
+  std::condition_variable window_changed;
+  std::deque<GameRef> window;
+  // Number of positions of all games ever added, but those dropped.
+  uint64_t end_position = 0;
+  size_t invalid_games = 0;
+
+  // Guards free_batches, ready_batches and has_positions.  Taken after window_mutex if both are.
+  std::mutex batch_mutex;
+  std::condition_variable batch_freed;
+  std::condition_variable batch_ready;
+  std::vector<Batch> batches;
+  std::vector<size_t> free_batches;
+  std::deque<size_t> ready_batches;
+  // Whether the window has positions to sample.
+  bool has_positions = false;
+
+  // Set under both mutexes.
+  std::atomic<bool> stopped{false};
+  std::vector<std::thread> workers;
+};
+
+using ReplayBuffer = BasicReplayBuffer<go_engine::N>;
+}  // namespace mcts
+
+#endif  // #ifndef INCLUDE_GUARD_REPLAY_BUFFER_H__
@@ -0,0 +1,196 @@
+// -*- mode:c++; c-basic-offset:2; coding:utf-8-unix -*-
+// ==================================================================================================
+#ifndef INCLUDE_GUARD_SELF_PLAY_H__
+#define INCLUDE_GUARD_SELF_PLAY_H__
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "batch_search.h"
+#include "board.h"
+#include "debug_msg.h"
+#include "eval_cache.h"
+#include "mcts.h"
+
+namespace mcts {
+
+struct SelfPlayOptions {
+  // Number of worker threads, each of them plays games_per_thread games at once with a BatchSearch.
+  unsigned threads = 1;
+  unsigned games_per_thread = 32;
+  // See BatchSearch.
+  unsigned simulations_per_game = 1;
+  // If positive, eval results are cached in an EvalCache shared by all workers.
+  size_t cache_entries = 0;
+  SearchOptions search;
+};
+
+// Plays self-play games end to end on a pool of worker threads.
+//
+// Workers never call the eval engine themselves: eval requests of all workers are queued and
+// served by the thread calling run(), which merges pending requests into a single batch.  This
+// keeps a Python eval function on the thread that created the model, and lets tree searches run
+// without the GIL.
+template<unsigned N>
+class BasicSelfPlayRunner {
+  using BoardInfo = go_engine::BasicBoardInfo<N>;
+  using GameRecord = BasicGameRecord<N>;
+  using EvalCache = BasicEvalCache<N>;
+  static constexpr size_t TotalMoves = BoardInfo::TotalMoves;
+
+  // A batch from one worker, owned by the worker blocked on it.
+  struct Request {
+    const std::vector<const BoardInfo*>* boards;
+    std::vector<std::array<float, TotalMoves>>* priors;
+    std::vector<float>* values;
+    bool done = false;
+  };
+
+  // BatchEvalEngine of the workers' BatchSearch.
+  struct QueuedEval {
+    void operator()(const std::vector<const BoardInfo*>& boards,
+                    std::vector<std::array<float, TotalMoves>>& priors,
+                    std::vector<float>& values) {
+      owner->submit(boards, priors, values);
+    }
+    BasicSelfPlayRunner* owner;
+  };
+public:
+  BasicSelfPlayRunner(float _komi, const SelfPlayOptions& _options = {})
+    : komi(_komi)
+    , options(_options)
+    , eval_cache(options.cache_entries > 0 ? new EvalCache(options.cache_entries) : nullptr)
+  {
+    options.threads = std::max(options.threads, 1U);
+    options.games_per_thread = std::max(options.games_per_thread, 1U);
+  }
+
+  // Play game_count games and pass each of them to sink(const GameRecord&), which is called from
+  // worker threads but never concurrently.  Workers stop once all games are claimed, games they
+  // still have in progress then are dropped.
+  //
+  // BatchEvalEngine has the same contract as in BatchSearch, and is only called by this thread.
+  // If debug_log is true, moves of one game of the first worker are logged.
+  template<typename BatchEvalEngine, typename GameSink>
+  void run(size_t game_count, BatchEvalEngine& eval, GameSink& sink, bool debug_log = false) {
+    claimed = 0;
+    active_workers = options.threads;
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < options.threads; ++t) {
+      workers.emplace_back([this, t, game_count, &sink, debug_log]() {
+          BasicBatchSearch<N, QueuedEval> search(komi, options.games_per_thread, QueuedEval{this},
+                                                 options.simulations_per_game, 0, options.search);
+          // Claim a game before playing it, so that exactly game_count games are passed to sink.
+          while (claimed.fetch_add(1, std::memory_order_relaxed) < game_count) {
+            std::vector<GameRecord> games = search.play(1, debug_log && t == 0);
+            std::lock_guard<std::mutex> lock(sink_mutex);
+            sink(games[0]);
+            // Other games finished at the same time are kept if there are games left to claim.
+            for (size_t k = 1; k < games.size() && claimed.fetch_add(1, std::memory_order_relaxed) < game_count; ++k) {
+              sink(games[k]);
+            }
+          }
+          std::lock_guard<std::mutex> lock(mutex);
+          --active_workers;
+          request_ready.notify_one();
+        });
+    }
+    serve(eval);
+    for (auto& w : workers) {
+      w.join();
+    }
+  }
+
+  // nullptr if caching is disabled.
+  const EvalCache* cache() const {
+    return eval_cache.get();
+  }
+private:
+  // Called by workers, blocks until the batch is evaluated.
+  void submit(const std::vector<const BoardInfo*>& boards,
+              std::vector<std::array<float, TotalMoves>>& priors,
+              std::vector<float>& values) {
+    Request r{&boards, &priors, &values};
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.push_back(&r);
+    request_ready.notify_one();
+    request_done.wait(lock, [&r]() { return r.done; });
+  }
+
+  // Evaluate queued requests until all workers have exited.
+  template<typename BatchEvalEngine>
+  void serve(BatchEvalEngine& eval) {
+    std::vector<Request*> batch;
+    std::vector<std::pair<Request*, size_t>> misses;
+    std::vector<const BoardInfo*> miss_boards;
+    std::vector<std::array<float, TotalMoves>> miss_priors;
+    std::vector<float> miss_values;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        request_ready.wait(lock, [this]() { return !queue.empty() || active_workers == 0; });
+        if (queue.empty()) break;
+        batch.swap(queue);
+      }
+
+      misses.clear();
+      miss_boards.clear();
+      for (Request* r : batch) {
+        for (size_t j = 0; j < r->boards->size(); ++j) {
+          const BoardInfo& b = *(*r->boards)[j];
+          if (eval_cache == nullptr || !eval_cache->lookup(b, (*r->priors)[j], (*r->values)[j])) {
+            misses.emplace_back(r, j);
+            miss_boards.push_back(&b);
+          }
+        }
+      }
+      if (!miss_boards.empty()) {
+        miss_priors.resize(miss_boards.size());
+        miss_values.resize(miss_boards.size());
+        eval(miss_boards, miss_priors, miss_values);
+        for (size_t k = 0; k < misses.size(); ++k) {
+          auto [r, j] = misses[k];
+          (*r->priors)[j] = miss_priors[k];
+          (*r->values)[j] = miss_values[k];
+          if (eval_cache != nullptr) {
+            eval_cache->insert(*miss_boards[k], miss_priors[k], miss_values[k]);
+          }
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Request* r : batch) {
+          r->done = true;
+        }
+      }
+      request_done.notify_all();
+      batch.clear();
+    }
+  }
+
+  const float komi;
+  SelfPlayOptions options;
+  std::unique_ptr<EvalCache> eval_cache;
+  // Number of games claimed by workers, may exceed game_count.
+  std::atomic<size_t> claimed{0};
+  std::mutex sink_mutex;
+
+  // Guards all members below.
+  std::mutex mutex;
+  std::condition_variable request_ready;
+  std::condition_variable request_done;
+  std::vector<Request*> queue;
+  unsigned active_workers = 0;
+};
+
+using SelfPlayRunner = BasicSelfPlayRunner<go_engine::N>;
+}  // namespace mcts
+
+#endif  // #ifndef INCLUDE_GUARD_SELF_PLAY_H__
@@ -0,0 +1,498 @@
+// -*- mode:c++; c-basic-offset:2; coding:utf-8-unix -*-
+// ==================================================================================================
+#ifndef INCLUDE_GUARD_SHARED_EVAL_H__
+#define INCLUDE_GUARD_SHARED_EVAL_H__
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "board_features.h"
+#include "debug_msg.h"
+#include "eval_batcher.h"
+
+namespace mcts {
+
+// Eval requests of many processes, batched by one server process through a POSIX shared memory
+// segment.
+//
+// Each client process takes a lane of slots in the segment, and writes inputs and reads outputs of
+// its requests in place.  The server batches filled slots of all lanes, so requests of a client
+// never wait on another one, and a client crash only loses its own lane, which the server reclaims
+// once the process is gone.
+//
+// A batch of consecutive slots is evaluated in place.  Otherwise, since the batch eval takes
+// contiguous arrays, inputs are gathered into buffers of the server and outputs copied back.
+namespace shared_eval {
+constexpr char Magic[8] = {'M', 'C', 'T', 'S', 'E', 'V', 'A', 'L'};
+constexpr uint32_t Version = 1;
+// How often the server looks for crashed clients.
+constexpr std::chrono::milliseconds ReclaimPeriod(100);
+// How often waiting clients check the server is still there.
+constexpr std::chrono::seconds ServerCheckPeriod(1);
+
+// A client moves its slots from Free to Filled and from Done to Free, the server from Filled to
+// Evaluating and Done.
+enum SlotState : uint32_t { Free, Filled, Evaluating, Done };
+
+struct Header {
+  // Written last by the server.
+  char magic[8] = {};
+  uint32_t version = Version;
+  uint32_t board_size = 0;
+  uint32_t clients = 0;
+  uint32_t slots = 0;
+  pid_t server_pid = 0;
+  std::atomic<uint32_t> stopped{0};
+  // Count of requests filled, which the server waits on.
+  alignas(64) FutexWord filled{0, true};
+};
+
+struct alignas(64) Lane {
+  // Client process using the lane, 0 if free.
+  std::atomic<pid_t> pid{0};
+  // Counters of the last client, kept after it is gone.
+  std::atomic<pid_t> last_pid{0};
+  std::atomic<uint32_t> crashed{0};
+  std::atomic<uint64_t> requests{0};
+  std::atomic<uint64_t> evaluated{0};
+};
+
+struct alignas(64) Slot {
+  FutexWord state{Free, true};
+};
+
+// Offsets of the parts of a segment: header, lanes, slots of all lanes in order, then inputs (see
+// fill_input_planes()), policies and values of all slots.
+struct Layout {
+  Layout(size_t board_size, size_t clients, size_t slots) {
+    const size_t n = clients * slots;
+    lanes = align(sizeof(Header));
+    slot_states = lanes + clients * sizeof(Lane);
+    input = slot_states + n * sizeof(Slot);
+    policy = align(input + n * 3 * board_size * board_size * sizeof(float));
+    value = align(policy + n * (board_size * board_size + 1) * sizeof(float));
+    size = align(value + n * sizeof(float));
+  }
+
+  static size_t align(size_t offset) {
+    return (offset + 63) / 64 * 64;
+  }
+
+  size_t lanes;
+  size_t slot_states;
+  size_t input;
+  size_t policy;
+  size_t value;
+  size_t size;
+};
+
+inline bool process_exists(pid_t pid) {
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// A mapping of a shared memory segment.
+class Mapping {
+public:
+  Mapping() = default;
+  Mapping(const Mapping&) = delete;
+  Mapping& operator=(const Mapping&) = delete;
+
+  ~Mapping() {
+    if (base != nullptr) munmap(base, size);
+  }
+
+  // Map all of fd, or size bytes if not 0 after resizing fd to it.  Return false on failure.
+  bool map(int fd, size_t _size = 0) {
+    if (_size > 0) {
+      if (ftruncate(fd, _size) != 0) return false;
+    } else {
+      struct stat st;
+      if (fstat(fd, &st) != 0) return false;
+      _size = st.st_size;
+    }
+    if (_size < sizeof(Header)) return false;
+    void* p = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) return false;
+    base = (char*)p;
+    size = _size;
+    return true;
+  }
+
+  char* base = nullptr;
+  size_t size = 0;
+};
+}  // namespace shared_eval
+
+// Evaluates batches of requests of BasicSharedEvalClient processes in serve().  The segment is
+// created on construction, replacing any existing one of the same name, and removed on destruction.
+//
+// Batches are dispatched as in EvalBatcher: once batch_size requests are filled, or once the first
+// one has waited max_wait (only full batches if max_wait is negative).
+template<unsigned N>
+class BasicSharedEvalServer {
+  using Clock = std::chrono::steady_clock;
+  using Header = shared_eval::Header;
+  using Lane = shared_eval::Lane;
+  using Slot = shared_eval::Slot;
+  static constexpr size_t TotalMoves = N * N + 1;
+  static constexpr size_t InputSize = 3 * N * N;
+public:
+  struct ClientStats {
+    pid_t pid;
+    bool connected;
+    // The process ended without disconnecting, its lane was reclaimed.
+    bool crashed;
+    uint64_t requests;
+    uint64_t evaluated;
+  };
+
+  // Serve up to clients processes at once, each with up to slots requests at a time.  Check ok()
+  // before use.
+  BasicSharedEvalServer(const std::string& _name, size_t _clients, size_t _slots, size_t _batch_size,
+                        std::chrono::microseconds _max_wait)
+    : name(_name)
+    , clients(std::max<size_t>(_clients, 1))
+    , slots(std::max<size_t>(_slots, 1))
+    , batch_size(std::max<size_t>(_batch_size, 1))
+    , max_wait(_max_wait)
+    , layout(N, clients, slots)
+  {
+    shm_unlink(name.c_str());
+    const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return;
+    const bool mapped = mapping.map(fd, layout.size);
+    close(fd);
+    if (!mapped) {
+      shm_unlink(name.c_str());
+      return;
+    }
+    header = new(mapping.base) Header();
+    header->board_size = N;
+    header->clients = clients;
+    header->slots = slots;
+    header->server_pid = getpid();
+    lanes = (Lane*)(mapping.base + layout.lanes);
+    for (size_t l = 0; l < clients; ++l) {
+      new(&lanes[l]) Lane();
+    }
+    slot_states = (Slot*)(mapping.base + layout.slot_states);
+    for (size_t i = 0; i < clients * slots; ++i) {
+      new(&slot_states[i]) Slot();
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, shared_eval::Magic, sizeof(header->magic));
+  }
+
+  ~BasicSharedEvalServer() {
+    if (header != nullptr) shm_unlink(name.c_str());
+  }
+  BasicSharedEvalServer(const BasicSharedEvalServer&) = delete;
+  BasicSharedEvalServer& operator=(const BasicSharedEvalServer&) = delete;
+
+  bool ok() const {
+    return header != nullptr;
+  }
+
+  // Evaluate batches until stop() is called.  BatchEval has the contract of the one passed to
+  // EvalBatcher::serve().  Requests still pending then are not served, their clients fail.
+  template<typename BatchEval>
+  void serve(BatchEval& eval) {
+    // Global indexes of slots in the batch, which are Evaluating.
+    std::vector<size_t> batch;
+    std::vector<float> input(batch_size * InputSize);
+    std::vector<float> policy(batch_size * TotalMoves);
+    std::vector<float> value(batch_size);
+    Clock::time_point next_check = Clock::now();
+    Clock::time_point deadline;
+    // First lane to take requests from, rotated for fairness.
+    size_t first_lane = 0;
+    while (header->stopped.load(std::memory_order_acquire) == 0) {
+      if (Clock::now() >= next_check) {
+        reclaim(batch);
+        next_check = Clock::now() + shared_eval::ReclaimPeriod;
+      }
+      const uint32_t seen = header->filled.load();
+      const bool was_empty = batch.empty();
+      take_requests(first_lane, batch);
+      if (was_empty && !batch.empty()) {
+        deadline = Clock::now() + max_wait;
+      }
+      const bool ready = batch.size() == batch_size ||
+        (!batch.empty() && max_wait.count() >= 0 && Clock::now() >= deadline);
+      if (!ready) {
+        const Clock::time_point until = batch.empty() || max_wait.count() < 0 ? next_check : std::min(deadline, next_check);
+        header->filled.wait_until([seen](uint32_t v) { return v != seen; }, &until);
+        continue;
+      }
+
+      const size_t n = batch.size();
+      if (std::adjacent_find(batch.begin(), batch.end(), [](size_t i, size_t j) { return j != i + 1; }) == batch.end()) {
+        // Consecutive slots, evaluated in place.
+        eval(n, slot_input(batch.front()), slot_policy(batch.front()), slot_value(batch.front()));
+      } else {
+        for (size_t k = 0; k < n; ++k) {
+          memcpy(input.data() + k * InputSize, slot_input(batch[k]), sizeof(float) * InputSize);
+        }
+        eval(n, input.data(), policy.data(), value.data());
+        for (size_t k = 0; k < n; ++k) {
+          memcpy(slot_policy(batch[k]), policy.data() + k * TotalMoves, sizeof(float) * TotalMoves);
+          *slot_value(batch[k]) = value[k];
+        }
+      }
+      for (size_t i : batch) {
+        lanes[i / slots].evaluated.fetch_add(1, std::memory_order_relaxed);
+        slot_states[i].state.store(shared_eval::Done);
+      }
+      batch.clear();
+      first_lane = (first_lane + 1) % clients;
+    }
+  }
+
+  // Make serve() return, may be called from any thread.
+  void stop() {
+    header->stopped.store(1, std::memory_order_release);
+    header->filled.add(1);
+  }
+
+  // Counters of all lanes ever used.
+  std::vector<ClientStats> client_stats() const {
+    std::vector<ClientStats> stats;
+    for (size_t l = 0; l < clients; ++l) {
+      const Lane& lane = lanes[l];
+      if (lane.last_pid.load() == 0) continue;
+      stats.push_back({lane.last_pid.load(), lane.pid.load() != 0, lane.crashed.load() != 0, lane.requests.load(),
+                       lane.evaluated.load()});
+    }
+    return stats;
+  }
+private:
+  // Move filled slots to batch until it is full, starting from first_lane.
+  void take_requests(size_t first_lane, std::vector<size_t>& batch) {
+    for (size_t k = 0; k < clients && batch.size() < batch_size; ++k) {
+      const size_t l = (first_lane + k) % clients;
+      if (lanes[l].pid.load(std::memory_order_relaxed) == 0) continue;
+      for (size_t i = l * slots; i < (l + 1) * slots && batch.size() < batch_size; ++i) {
+        // Only the server changes Filled slots.
+        if (slot_states[i].state.load() == shared_eval::Filled) {
+          slot_states[i].state.store(shared_eval::Evaluating);
+          batch.push_back(i);
+        }
+      }
+    }
+  }
+
+  // Free lanes of processes which are gone, and drop their requests from batch.
+  void reclaim(std::vector<size_t>& batch) {
+    for (size_t l = 0; l < clients; ++l) {
+      const pid_t pid = lanes[l].pid.load();
+      if (pid == 0 || shared_eval::process_exists(pid)) continue;
+      batch.erase(std::remove_if(batch.begin(), batch.end(), [this, l](size_t i) { return i / slots == l; }),
+                  batch.end());
+      for (size_t i = l * slots; i < (l + 1) * slots; ++i) {
+        slot_states[i].state.store(shared_eval::Free);
+      }
+      lanes[l].crashed.store(1);
+      lanes[l].pid.store(0, std::memory_order_release);
+    }
+  }
+
+  float* slot_input(size_t i) {
+    return (float*)(mapping.base + layout.input) + i * InputSize;
+  }
+
+  float* slot_policy(size_t i) {
+    return (float*)(mapping.base + layout.policy) + i * TotalMoves;
+  }
+
+  float* slot_value(size_t i) {
+    return (float*)(mapping.base + layout.value) + i;
+  }
+
+  const std::string name;
+  const size_t clients;
+  const size_t slots;
+  const size_t batch_size;
+  const std::chrono::microseconds max_wait;
+  const shared_eval::Layout layout;
+  shared_eval::Mapping mapping;
+  Header* header = nullptr;
+  Lane* lanes = nullptr;
+  Slot* slot_states = nullptr;
+};
+
+// Sends eval requests to a BasicSharedEvalServer of another process (or the same one).  Satisfies
+// the EvalEngine contract of Tree, and the BatchEvalEngine contract of BatchSearch, both of which
+// may be used from several threads at once.  Calls block while all slots of the lane are in use.
+//
+// Aborts if the server stops or exits while requests are pending.
+template<unsigned N>
+class BasicSharedEvalClient {
+  using Clock = std::chrono::steady_clock;
+  using BoardInfo = go_engine::BasicBoardInfo<N>;
+  using Header = shared_eval::Header;
+  using Lane = shared_eval::Lane;
+  using Slot = shared_eval::Slot;
+  static constexpr size_t TotalMoves = BoardInfo::TotalMoves;
+  static constexpr size_t InputSize = 3 * N * N;
+public:
+  // Connect to the server of segment name.  Check ok() before use, which fails if there is no
+  // server for board size N, or all its lanes are in use.
+  explicit BasicSharedEvalClient(const std::string& name) {
+    const int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) return;
+    const bool mapped = mapping.map(fd);
+    close(fd);
+    if (!mapped) return;
+    header = (Header*)mapping.base;
+    if (memcmp(header->magic, shared_eval::Magic, sizeof(header->magic)) != 0) return;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header->version != shared_eval::Version || header->board_size != N ||
+        shared_eval::Layout(N, header->clients, header->slots).size != mapping.size) {
+      return;
+    }
+    layout.reset(new shared_eval::Layout(N, header->clients, header->slots));
+    slots = header->slots;
+    Lane* lanes = (Lane*)(mapping.base + layout->lanes);
+    for (size_t l = 0; l < header->clients; ++l) {
+      pid_t expected = 0;
+      if (lanes[l].pid.compare_exchange_strong(expected, getpid())) {
+        lane = &lanes[l];
+        first_slot = l * slots;
+        break;
+      }
+    }
+    if (lane == nullptr) return;
+    lane->requests.store(0);
+    lane->evaluated.store(0);
+    lane->crashed.store(0);
+    lane->last_pid.store(getpid());
+    for (size_t i = 0; i < slots; ++i) {
+      free_slots.push_back(first_slot + i);
+    }
+  }
+
+  // No requests may be pending.
+  ~BasicSharedEvalClient() {
+    if (lane != nullptr) lane->pid.store(0, std::memory_order_release);
+  }
+  BasicSharedEvalClient(const BasicSharedEvalClient&) = delete;
+  BasicSharedEvalClient& operator=(const BasicSharedEvalClient&) = delete;
+
+  bool ok() const {
+    return lane != nullptr;
+  }
+
+  float operator()(const BoardInfo& b, std::array<float, TotalMoves>& prior) {
+    const size_t i = claim();
+    send(i, b);
+    return receive(i, prior.data());
+  }
+
+  void operator()(const std::vector<const BoardInfo*>& boards,
+                  std::vector<std::array<float, TotalMoves>>& priors,
+                  std::vector<float>& values) {
+    // Requests sent, by index of boards, and their slots.
+    std::vector<std::pair<size_t, size_t>> pending;
+    size_t done = 0;
+    for (size_t k = 0; k < boards.size(); ++k) {
+      size_t i;
+      // Receive results of our own requests rather than waiting for other threads.
+      while (!try_claim(&i)) {
+        if (done < pending.size()) {
+          values[pending[done].first] = receive(pending[done].second, priors[pending[done].first].data());
+          ++done;
+        } else {
+          i = claim();
+          break;
+        }
+      }
+      send(i, *boards[k]);
+      pending.emplace_back(k, i);
+    }
+    for (; done < pending.size(); ++done) {
+      values[pending[done].first] = receive(pending[done].second, priors[pending[done].first].data());
+    }
+  }
+private:
+  bool try_claim(size_t* i) {
+    std::lock_guard<std::mutex> lock(slot_mutex);
+    if (free_slots.empty()) return false;
+    *i = free_slots.back();
+    free_slots.pop_back();
+    return true;
+  }
+
+  size_t claim() {
+    std::unique_lock<std::mutex> lock(slot_mutex);
+    slot_freed.wait(lock, [this]() { return !free_slots.empty(); });
+    const size_t i = free_slots.back();
+    free_slots.pop_back();
+    return i;
+  }
+
+  void send(size_t i, const BoardInfo& b) {
+    go_engine::fill_input_planes(b, (float*)(mapping.base + layout->input) + i * InputSize);
+    lane->requests.fetch_add(1, std::memory_order_relaxed);
+    slot(i).state.store(shared_eval::Filled);
+    header->filled.add(1);
+  }
+
+  float receive(size_t i, float* prior) {
+    Slot& s = slot(i);
+    while (true) {
+      const Clock::time_point deadline = Clock::now() + shared_eval::ServerCheckPeriod;
+      if (s.state.wait(shared_eval::Done, &deadline)) break;
+      CHECK(header->stopped.load() == 0 && shared_eval::process_exists(header->server_pid))
+        << "The eval server is gone.";
+    }
+    memcpy(prior, (float*)(mapping.base + layout->policy) + i * TotalMoves, sizeof(float) * TotalMoves);
+    const float value = ((float*)(mapping.base + layout->value))[i];
+    s.state.store(shared_eval::Free);
+    {
+      std::lock_guard<std::mutex> lock(slot_mutex);
+      free_slots.push_back(i);
+    }
+    slot_freed.notify_one();
+    return value;
+  }
+
+  Slot& slot(size_t i) {
+    return ((Slot*)(mapping.base + layout->slot_states))[i];
+  }
+
+  shared_eval::Mapping mapping;
+  std::unique_ptr<shared_eval::Layout> layout;
+  Header* header = nullptr;
+  Lane* lane = nullptr;
+  size_t first_slot = 0;
+  size_t slots = 0;
+
+  // Guards free_slots, slots of the lane not in use by a thread.
+  std::mutex slot_mutex;
+  std::condition_variable slot_freed;
+  std::vector<size_t> free_slots;
+};
+
+using SharedEvalServer = BasicSharedEvalServer<go_engine::N>;
+using SharedEvalClient = BasicSharedEvalClient<go_engine::N>;
+}  // namespace mcts
+
+#endif  // #ifndef INCLUDE_GUARD_SHARED_EVAL_H__
@@ -1,5 +1,5 @@
 #!/usr/bin/env python3
-import random, sys, glob
+import random, sys, glob, struct
 import numpy as np
 import mcts
 import tensorflow as tf
@@ -38,6 +38,20 @@ def build_network_model():
     value = tf.keras.layers.Dense(1, kernel_regularizer=tf.keras.regularizers.l2(1.e-4), activation=tf.keras.activations.sigmoid, name='value')(value)
     return tf.keras.models.Model(inputs=[inputs], outputs=[policy, value])
 
+def write_weights(filename, layers, head_format):
+    """Write weights of the layers of build_network_model() in the format of cpu_network.h.
+
+    layers are [kernel, bias] of the trunk convs, policy conv, policy dense, value conv, hidden value
+    dense and value dense, in this order."""
+    channels = layers[0][1].shape[0]
+    blocks = (len(layers) - 6) // 2
+    units = layers[-2][1].shape[0]
+    with open(filename, 'wb') as f:
+        f.write(struct.pack('<8s6I', b'MCTSNETW', 1, size, channels, blocks, units, head_format))
+        for kernel, bias in layers:
+            f.write(np.ascontiguousarray(kernel, dtype='<f4').tobytes())
+            f.write(np.ascontiguousarray(bias, dtype='<f4').tobytes())
+
 def find_latest_model():
     models = sorted(glob.glob('data/network.*'))
     if models:
@@ -68,5 +82,27 @@ class Network:
     def store(self, filename):
         self.model.save(filename)
 
+    def export_weights(self, filename):
+        """Export weights for mcts.CpuNetwork."""
+        convs = [l for l in self.model.layers if isinstance(l, tf.keras.layers.Conv2D)]
+        trunk = [l for l in convs if l.filters > 2]
+        policy_conv = next(l for l in convs if l.filters == 2)
+        value_conv = next(l for l in convs if l.filters == 1)
+        policy = self.model.get_layer('policy')
+        value = self.model.get_layer('value')
+        value_hidden = next(l for l in self.model.layers
+                            if isinstance(l, tf.keras.layers.Dense) and l not in (policy, value))
+        layers = trunk + [policy_conv, policy, value_conv, value_hidden, value]
+        head_format = 0 if policy_conv.data_format == 'channels_last' else 1
+        write_weights(filename, [l.get_weights() for l in layers], head_format)
+
     def fit(self, x, y, epochs=5):
         self.model.fit(x, y, epochs=epochs)
+
+    def fit_generator(self, batches, steps_per_epoch, epochs=5):
+        # Batches of mcts.ReplayBuffer are produced by C++ threads, so no Keras workers are needed.
+        self.model.fit_generator(batches, steps_per_epoch=steps_per_epoch, epochs=epochs, workers=0)
+
+if __name__ == '__main__':
+    # Export the latest model for mcts.CpuNetwork: tf_network.py <filename>
+    Network().export_weights(sys.argv[1])
@@ -1,4 +1,4 @@
-import numpy, time, glob
+import numpy, time, glob, os
 import mcts, board
 import tensorflow as tf
 from tf_network import Network
@@ -6,37 +6,18 @@ import training_data_io
 
 SIZE = mcts.board_size()
 KOMI = 7.5
+# Train on all 8 symmetries of each position.
+SYMMETRIES = False
 
 def transform_training_data(games):
-    x = []
-    y0 = []
-    y1 = []
-    for g in games:
-        moves = g[0]
-        score = g[1]
-        b = board.Board(KOMI)
-        for m in moves:
-            color = 0 if m[0] == 'B' else 1
-            move = m[1]
-            network_input = numpy.empty([3, SIZE, SIZE], dtype=numpy.float32)
-            for pos_x in range(SIZE):
-                for pos_y in range(SIZE):
-                    network_input[0, pos_x, pos_y] = b.has_stone(color, pos_x * SIZE + pos_y)
-                    network_input[1, pos_x, pos_y] = b.has_stone(1 - color, pos_x * SIZE + pos_y)
-                    network_input[2, pos_x, pos_y] = color
-
-            assert(len(m[2]) == SIZE * SIZE + 1)
-            network_output_policy = numpy.array(m[2], dtype=numpy.float32)
-            network_output_policy += 1.e-5
-            network_output_policy = network_output_policy / numpy.sum(network_output_policy)
-            network_output_value = 1.e-5 + numpy.array([color if score < 0 else 1 - color], dtype=numpy.float32) * (1. - 1.e-5 * 2.)
-            b.play(color, move)
-            x.append(network_input)
-            y0.append(network_output_policy)
-            y1.append(network_output_value)
-        if score != b.score():
-            raise ValueError('Score mismatch: {} (file) !=  {} (board).'.format(b.score(), score))
-    return numpy.stack(x), [numpy.stack(y0), numpy.stack(y1)]
+    rows = sum(len(moves) for moves, _ in games) * (8 if SYMMETRIES else 1)
+    x = numpy.empty([rows, 3, SIZE, SIZE], dtype=numpy.float32)
+    policy = numpy.empty([rows, SIZE * SIZE + 1], dtype=numpy.float32)
+    value = numpy.empty([rows, 1], dtype=numpy.float32)
+    # Raises ValueError if a game doesn't replay to its recorded score.
+    board.encode_games(games, x, policy, value, symmetries=SYMMETRIES, threads=os.cpu_count(), komi=KOMI,
+                       size=SIZE)
+    return x, [policy, value]
 
 def load_training_data():
     training_data = sorted(glob.glob('data/training_data.*'))
@@ -44,11 +25,44 @@ def load_training_data():
     # Transform into a format useable for model training.
     return transform_training_data(all_games)
 
-x, y = load_training_data()
+# Games kept by the replay buffer, and the batch size of training.
+WINDOW = 250000
+BATCH_SIZE = 256
+
+def load_replay_buffer():
+    training_data = sorted(glob.glob('data/training_data.*'))
+    # Only the most recent binary files needed to fill the window are opened.
+    recent = []
+    games = 0
+    for filename in reversed(training_data):
+        if games >= WINDOW:
+            break
+        try:
+            games += mcts.GameFile(filename).game_count()
+        except OSError:
+            continue
+        recent.append(filename)
+    if not recent:
+        return None
+    buffer = mcts.ReplayBuffer(WINDOW, BATCH_SIZE, threads=os.cpu_count(), symmetries=SYMMETRIES, size=SIZE)
+    for filename in reversed(recent):
+        buffer.add_file(filename)
+    return buffer
+
+buffer = load_replay_buffer()
+if buffer is None:
+    # Only text files from older versions.
+    x, y = load_training_data()
 
 gpu_options = tf.GPUOptions(per_process_gpu_memory_fraction=0.20)
 with tf.Session(config=tf.ConfigProto(gpu_options=gpu_options)):
     network = Network()
     print(network.model.summary())
-    network.fit(x, y, epochs=2)
-    network.store('data/network.{}'.format(int(time.time())))
+    if buffer is None:
+        network.fit(x, y, epochs=2)
+    else:
+        network.fit_generator(buffer, steps_per_epoch=max(buffer.position_count() // BATCH_SIZE, 1), epochs=2)
+    timestamp = int(time.time())
+    network.store('data/network.{}'.format(timestamp))
+    # For mcts.CpuNetwork.
+    network.export_weights('data/weights.{}'.format(timestamp))
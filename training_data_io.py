@@ -54,7 +54,19 @@ def read_one_game(f):
         moves.append([m_str[0], int(m_str[1]), [int(v) for v in m_str[3:]]])
     return (moves, score)
 
+# Binary files written by mcts.self_play(), see game_io.h for the format.
+BINARY_MAGIC = b'MCTSGAME'
+
+def load_binary(filename):
+    f = mcts.GameFile(filename)
+    assert f.board_size() == SIZE, 'Invalid game file, expect SIZE = {}: {}.'.format(SIZE, f.board_size())
+    assert f.komi() == KOMI, 'Invalid game file, expect KOMI = {}: {}.'.format(KOMI, f.komi())
+    return f.games()
+
 def load(filename):
+    with open(filename, 'rb') as f:
+        if f.read(len(BINARY_MAGIC)) == BINARY_MAGIC:
+            return load_binary(filename)
     games = []
     with open(filename, 'r') as f:
         while True: